@@ -0,0 +1,236 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "clox.h"
+#include "compiler.h"
+#include "object.h"
+#include "vm.h"
+
+// Every entry point makes its handle the current VM and puts back
+// the one it interrupted, so a native of one VM can drive another.
+
+static VM *enter(LoxVM *handle)
+{
+  VM *interrupted = vm;
+  vm = handle;
+  return interrupted;
+}
+static void leave(VM *interrupted)
+{
+  vm = interrupted;
+}
+static Value *slotAt(int index)
+{
+  return index >= 0 ? vm->stack + vm->apiBase + index : vm->stackTop + index;
+}
+static LoxResult toLoxResult(InterpretResult result)
+{
+  switch (result)
+  {
+  case INTERPRET_COMPILE_ERROR:
+    return LOX_COMPILE_ERROR;
+  case INTERPRET_RUNTIME_ERROR:
+    return LOX_RUNTIME_ERROR;
+  default:
+    return LOX_OK;
+  }
+}
+
+LoxVM *loxNewVM()
+{
+  VM *interrupted = vm;
+  VM *created = newVM();
+  leave(interrupted);
+  return created;
+}
+void loxFreeVM(LoxVM *handle)
+{
+  VM *interrupted = enter(handle);
+  freeVM();
+  leave(interrupted == handle ? NULL : interrupted);
+}
+
+LoxResult loxInterpret(LoxVM *handle, const char *source)
+{
+  VM *interrupted = enter(handle);
+  InterpretResult result = interpret(source);
+  leave(interrupted);
+  return toLoxResult(result);
+}
+LoxResult loxLoad(LoxVM *handle, const char *source)
+{
+  VM *interrupted = enter(handle);
+  ObjFunction *function = compile(source);
+  if (function != NULL)
+  {
+    // a script captures nothing, it runs without a closure
+    push(OBJ_VAL(function));
+  }
+  leave(interrupted);
+  return function != NULL ? LOX_OK : LOX_COMPILE_ERROR;
+}
+LoxResult loxCall(LoxVM *handle, int argCount)
+{
+  VM *interrupted = enter(handle);
+  InterpretResult result = callAndRun(argCount);
+  leave(interrupted);
+  return toLoxResult(result);
+}
+void loxRegister(LoxVM *handle, const char *name, LoxNative function, int arity)
+{
+  VM *interrupted = enter(handle);
+  defineNative(name, function, arity);
+  leave(interrupted);
+}
+bool loxError(LoxVM *handle, const char *format, ...)
+{
+  char message[512];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+  VM *interrupted = enter(handle);
+  runtimeError("%s", message);
+  leave(interrupted);
+  return false;
+}
+
+void loxSetGCThreads(LoxVM *handle, int threads)
+{
+  handle->gcThreads = threads > 0 ? threads : 1;
+}
+
+void loxSetMaxFrames(LoxVM *handle, int frames)
+{
+  handle->framesMax = frames > 0 ? frames : 1;
+}
+
+void loxSetGCPause(LoxVM *handle, int micros)
+{
+  handle->gcPauseMicros = micros > 0 ? micros : 0;
+}
+
+void loxSetJit(LoxVM *handle, bool enabled)
+{
+  handle->jitEnabled = enabled;
+}
+
+bool loxGetGlobal(LoxVM *handle, const char *name)
+{
+  VM *interrupted = enter(handle);
+  Value slot;
+  ObjString *string = copyString(name, (int)strlen(name));
+  bool found = tableGet(&vm->globalNames, string, &slot) &&
+               !IS_UNDEFINED(vm->globalValues.values[(int)AS_NUMBER(slot)]);
+  if (found)
+    push(vm->globalValues.values[(int)AS_NUMBER(slot)]);
+  leave(interrupted);
+  return found;
+}
+void loxSetGlobal(LoxVM *handle, const char *name)
+{
+  VM *interrupted = enter(handle);
+  // the value stays on the stack while the name is allocated
+  push(OBJ_VAL(copyString(name, (int)strlen(name))));
+  int slot = globalSlot(AS_STRING(vm->stackTop[-1]));
+  snapshotBarrier(vm->globalValues.values[slot]);
+  vm->globalValues.values[slot] = vm->stackTop[-2];
+  globalWriteBarrier(slot, vm->stackTop[-2]);
+  pop();
+  pop();
+  leave(interrupted);
+}
+
+int loxGetTop(LoxVM *handle)
+{
+  return (int)(handle->stackTop - handle->stack) - handle->apiBase;
+}
+void loxPop(LoxVM *handle, int count)
+{
+  handle->stackTop -= count;
+}
+void loxPushNil(LoxVM *handle)
+{
+  VM *interrupted = enter(handle);
+  push(NIL_VAL);
+  leave(interrupted);
+}
+void loxPushBool(LoxVM *handle, bool value)
+{
+  VM *interrupted = enter(handle);
+  push(BOOL_VAL(value));
+  leave(interrupted);
+}
+void loxPushNumber(LoxVM *handle, double value)
+{
+  VM *interrupted = enter(handle);
+  push(NUMBER_VAL(value));
+  leave(interrupted);
+}
+void loxPushString(LoxVM *handle, const char *chars, int length)
+{
+  VM *interrupted = enter(handle);
+  push(OBJ_VAL(copyString(chars, length)));
+  leave(interrupted);
+}
+
+bool loxIsNil(LoxVM *handle, int index)
+{
+  VM *interrupted = enter(handle);
+  bool is = IS_NIL(*slotAt(index));
+  leave(interrupted);
+  return is;
+}
+bool loxIsBool(LoxVM *handle, int index)
+{
+  VM *interrupted = enter(handle);
+  bool is = IS_BOOL(*slotAt(index));
+  leave(interrupted);
+  return is;
+}
+bool loxIsNumber(LoxVM *handle, int index)
+{
+  VM *interrupted = enter(handle);
+  bool is = IS_NUMBER(*slotAt(index));
+  leave(interrupted);
+  return is;
+}
+bool loxIsString(LoxVM *handle, int index)
+{
+  VM *interrupted = enter(handle);
+  bool is = IS_STRING_OR_ROPE(*slotAt(index));
+  leave(interrupted);
+  return is;
+}
+bool loxToBool(LoxVM *handle, int index)
+{
+  VM *interrupted = enter(handle);
+  Value value = *slotAt(index);
+  leave(interrupted);
+  return !IS_NIL(value) && !(IS_BOOL(value) && !AS_BOOL(value));
+}
+double loxToNumber(LoxVM *handle, int index)
+{
+  VM *interrupted = enter(handle);
+  Value value = *slotAt(index);
+  leave(interrupted);
+  return IS_NUMBER(value) ? AS_NUMBER(value) : 0;
+}
+const char *loxToString(LoxVM *handle, int index, int *length)
+{
+  VM *interrupted = enter(handle);
+  Value value = *slotAt(index);
+  ObjString *string = NULL;
+  if (IS_STRING(value))
+    string = AS_STRING(value);
+  // the rope keeps its flattened string alive
+  else if (IS_ROPE(value))
+    string = flattenRope(AS_ROPE(value));
+  leave(interrupted);
+  if (string == NULL)
+    return NULL;
+  if (length != NULL)
+    *length = string->length;
+  return string->chars;
+}
@@ -0,0 +1,81 @@
+// Collector scaling benchmark. Builds a heap of a binary tree of
+// closures, each holding a string of its own, times major
+// collections of it with 1, 2, 4 and 8 threads, and prints the
+// results as JSON on stdout. Every collection finds the whole
+// tree alive, the tree is counted again at the end to check it.
+//
+//   make bench-gc && ./bench/gc
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "common.h"
+#include "memory.h"
+#include "vm.h"
+
+#define ROUNDS 5
+
+static const char *buildTree =
+    "fun node(left, right, name)\n"
+    "{\n"
+    "  fun get(which)\n"
+    "  {\n"
+    "    if (which == 0) return left;\n"
+    "    if (which == 1) return right;\n"
+    "    return name;\n"
+    "  }\n"
+    "  return get;\n"
+    "}\n"
+    "fun build(depth, name)\n"
+    "{\n"
+    "  if (depth == 0) return node(nil, nil, name);\n"
+    "  return node(build(depth - 1, name + \"l\"), build(depth - 1, name + \"r\"), name);\n"
+    "}\n"
+    "fun count(tree)\n"
+    "{\n"
+    "  if (tree == nil) return 0;\n"
+    "  return 1 + count(tree(0)) + count(tree(1));\n"
+    "}\n"
+    "var tree = build(18, \"n\");\n";
+
+static double now()
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+static int compareTimes(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+int main()
+{
+  newVM();
+  if (interpret(buildTree) != INTERPRET_OK)
+    return 1;
+  collectGarbage();
+  printf("{\"heap_bytes\": %zu, \"collections\": [\n", vm->bytesAllocated);
+  int threadCounts[] = {1, 2, 4, 8};
+  for (int i = 0; i < 4; i++)
+  {
+    vm->gcThreads = threadCounts[i];
+    double times[ROUNDS];
+    for (int round = 0; round < ROUNDS; round++)
+    {
+      double start = now();
+      collectGarbage();
+      times[round] = now() - start;
+    }
+    qsort(times, ROUNDS, sizeof(double), compareTimes);
+    printf("  {\"threads\": %d, \"median_ms\": %.2f, \"min_ms\": %.2f}%s\n",
+           threadCounts[i], times[ROUNDS / 2] * 1e3, times[0] * 1e3, i < 3 ? "," : "");
+  }
+  printf("]}\n");
+  // 2^19 - 1 nodes
+  interpret("if (count(tree) != 524287) print \"tree damaged\";");
+  freeVM();
+  return 0;
+}
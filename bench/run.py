@@ -0,0 +1,188 @@
+"""Benchmark harness for clox.
+
+Runs every bench/*.lox program with one or two clox builds and prints
+the results as JSON on stdout.
+
+  python3 bench/run.py ./clox
+  python3 bench/run.py --compare old/clox ./clox
+
+Each program is run `--warmup` times untimed and then `--runs` times.
+Wall time is reported as min/median/p90/max. Peak RSS is measured on one
+extra run by sampling VmHWM from /proc, since the rusage of a child forked
+from Python starts out with the interpreter's own high-water mark. Builds
+with a bytecode cache run with --no-cache, so every run of every build
+compiles its program instead of loading a .loxc left by an earlier one. In
+compare mode a benchmark is
+flagged as a regression when its median is more than `--threshold`
+slower than the baseline, and the exit status is 1 if any regressed.
+"""
+
+import argparse
+import glob
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+
+# the command line of each build, see command()
+commands = {}
+
+
+def percentile(samples, p):
+    # linear interpolation between closest ranks
+    ordered = sorted(samples)
+    k = (len(ordered) - 1) * p / 100.0
+    lo = int(k)
+    hi = min(lo + 1, len(ordered) - 1)
+    return ordered[lo] + (ordered[hi] - ordered[lo]) * (k - lo)
+
+
+def command(clox):
+    # builds from before the bytecode cache reject --no-cache,
+    # and have no cache to turn off
+    if clox not in commands:
+        with tempfile.NamedTemporaryFile("w", suffix=".lox") as empty:
+            probe = subprocess.run([clox, "--no-cache", empty.name],
+                                   stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        commands[clox] = [clox, "--no-cache"] if probe.returncode == 0 else [clox]
+    return commands[clox]
+
+
+def spawn(clox, script):
+    # output goes to temporary files so a full pipe
+    # can never stall the measured process
+    out = tempfile.TemporaryFile()
+    err = tempfile.TemporaryFile()
+    return subprocess.Popen(command(clox) + [script], stdout=out, stderr=err), out, err
+
+
+def finish(clox, script, out, err, status):
+    out.seek(0)
+    err.seek(0)
+    output = out.read().decode()
+    errors = err.read().decode()
+    out.close()
+    err.close()
+    code = os.waitstatus_to_exitcode(status)
+    if code != 0:
+        raise RuntimeError("%s %s exited with %d\n%s" % (clox, script, code, errors))
+    return output
+
+
+def run_once(clox, script):
+    start = time.perf_counter()
+    proc, out, err = spawn(clox, script)
+    _, status = os.waitpid(proc.pid, 0)
+    elapsed = time.perf_counter() - start
+    return elapsed, finish(clox, script, out, err, status)
+
+
+def peak_rss(clox, script):
+    # VmHWM only grows, so the last sample before exit is
+    # the peak up to the final millisecond of the run
+    proc, out, err = spawn(clox, script)
+    peak = 0
+    status_path = "/proc/%d/status" % proc.pid
+    while True:
+        pid, status = os.waitpid(proc.pid, os.WNOHANG)
+        if pid != 0:
+            break
+        try:
+            with open(status_path) as f:
+                for line in f:
+                    if line.startswith("VmHWM:"):
+                        peak = max(peak, int(line.split()[1]))
+        except (OSError, ValueError):
+            pass
+        time.sleep(0.001)
+    finish(clox, script, out, err, status)
+    return peak
+
+
+def bench(clox, script, runs, warmup):
+    for _ in range(warmup):
+        run_once(clox, script)
+    times = []
+    output = None
+    for _ in range(runs):
+        elapsed, output = run_once(clox, script)
+        times.append(elapsed)
+    peak = peak_rss(clox, script)
+    return {
+        "name": os.path.splitext(os.path.basename(script))[0],
+        "runs": runs,
+        "min_s": round(min(times), 6),
+        "median_s": round(percentile(times, 50), 6),
+        "p90_s": round(percentile(times, 90), 6),
+        "max_s": round(max(times), 6),
+        "peak_rss_kb": peak,
+        "output": output.strip(),
+    }
+
+
+def suite(clox, scripts, runs, warmup):
+    results = []
+    for script in scripts:
+        result = bench(clox, script, runs, warmup)
+        print("%-12s median %.3fs p90 %.3fs rss %d KB" %
+              (result["name"], result["median_s"], result["p90_s"], result["peak_rss_kb"]),
+              file=sys.stderr)
+        results.append(result)
+    return {"clox": clox, "command": command(clox), "warmup": warmup, "benchmarks": results}
+
+
+def compare(base, new, threshold):
+    baseline = {b["name"]: b for b in base["benchmarks"]}
+    rows = []
+    for result in new["benchmarks"]:
+        old = baseline.get(result["name"])
+        if old is None:
+            continue
+        ratio = result["median_s"] / old["median_s"]
+        rows.append({
+            "name": result["name"],
+            "base_median_s": old["median_s"],
+            "median_s": result["median_s"],
+            "ratio": round(ratio, 4),
+            "base_peak_rss_kb": old["peak_rss_kb"],
+            "peak_rss_kb": result["peak_rss_kb"],
+            "output_matches": old["output"] == result["output"],
+            "regression": ratio > 1 + threshold,
+        })
+    return rows
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Run the clox benchmark suite.")
+    parser.add_argument("clox", help="clox binary to measure")
+    parser.add_argument("--compare", metavar="BASE", help="baseline clox binary to compare against")
+    parser.add_argument("--runs", type=int, default=5, help="timed runs per program (default 5)")
+    parser.add_argument("--warmup", type=int, default=1, help="untimed runs per program (default 1)")
+    parser.add_argument("--threshold", type=float, default=0.05,
+                        help="median slowdown counted as a regression (default 0.05)")
+    parser.add_argument("--filter", default="", help="only run programs whose name contains this")
+    args = parser.parse_args()
+
+    scripts = [s for s in sorted(glob.glob(os.path.join(BENCH_DIR, "*.lox")))
+               if args.filter in os.path.basename(s)]
+    result = suite(args.clox, scripts, args.runs, args.warmup)
+    if args.compare is None:
+        print(json.dumps(result, indent=2))
+        return 0
+
+    base = suite(args.compare, scripts, args.runs, args.warmup)
+    rows = compare(base, result, args.threshold)
+    print(json.dumps({"base": base, "new": result, "comparison": rows}, indent=2))
+    regressed = [r["name"] for r in rows if r["regression"] or not r["output_matches"]]
+    if regressed:
+        print("regressions: " + ", ".join(regressed), file=sys.stderr)
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
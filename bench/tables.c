@@ -0,0 +1,158 @@
+// Table microbenchmark. Times hit, miss, insert and delete-heavy
+// mixes on tables keyed by interned strings, the interning probe
+// tableFindString(), and hashString() and copyString() on identifier
+// sized and on kilobyte strings, then prints the results as JSON on
+// stdout along with the probe length histograms of a full and of a
+// churned table.
+//
+//   make bench-tables && ./bench/tables
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "common.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+#define KEY_COUNT (1 << 16)
+#define ROUNDS 20
+// keys alive at once in the delete-heavy mix
+#define WINDOW 1024
+#define HISTOGRAM_BUCKETS 8
+#define LONG_COUNT 256
+#define LONG_LENGTH 1024
+
+static ObjString *keys[KEY_COUNT];
+static ObjString *missing[KEY_COUNT];
+static ObjString *longKeys[LONG_COUNT];
+static volatile int sink;
+
+static double now()
+{
+  return (double)clock() / CLOCKS_PER_SEC;
+}
+static void report(const char *mix, long ops, double seconds, bool last)
+{
+  printf("  {\"mix\": \"%s\", \"ops\": %ld, \"ns_per_op\": %.2f}%s\n",
+         mix, ops, seconds * 1e9 / ops, last ? "" : ",");
+}
+static void reportProbes(const char *name, Table *table)
+{
+  int histogram[HISTOGRAM_BUCKETS];
+  int longest = tableProbeLengths(table, histogram, HISTOGRAM_BUCKETS);
+  printf("  {\"table\": \"%s\", \"keys\": %d, \"capacity\": %d, \"longest_probe\": %d, \"probe_lengths\": [",
+         name, table->count, table->capacity, longest);
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    printf("%d%s", histogram[i], i < HISTOGRAM_BUCKETS - 1 ? ", " : "]},\n");
+}
+static void fillTable(Table *table)
+{
+  for (int i = 0; i < KEY_COUNT; i++)
+    tableSet(table, keys[i], NUMBER_VAL(i));
+}
+
+int main()
+{
+  newVM();
+  // the keys are not reachable from any root
+  vm->nextGC = SIZE_MAX;
+  char name[32];
+  for (int i = 0; i < KEY_COUNT; i++)
+  {
+    keys[i] = copyString(name, snprintf(name, sizeof(name), "key%d", i));
+    missing[i] = copyString(name, snprintf(name, sizeof(name), "missing%d", i));
+  }
+  // kilobyte strings that only differ in a few scattered characters
+  char text[LONG_LENGTH];
+  for (int i = 0; i < LONG_LENGTH; i++)
+    text[i] = 'a' + i % 26;
+  for (int i = 0; i < LONG_COUNT; i++)
+  {
+    text[i % LONG_LENGTH] = 'A' + i % 26;
+    text[(i * 7) % LONG_LENGTH] = '0' + i % 10;
+    text[LONG_LENGTH - 1] = (char)('!' + i % 64);
+    longKeys[i] = copyString(text, LONG_LENGTH);
+  }
+
+  printf("[\n");
+  Table table;
+  double start = now();
+  for (int round = 0; round < ROUNDS; round++)
+  {
+    initTable(&table);
+    fillTable(&table);
+    freeTable(&table);
+  }
+  report("insert", (long)ROUNDS * KEY_COUNT, now() - start, false);
+
+  initTable(&table);
+  fillTable(&table);
+  Value value;
+  start = now();
+  for (int round = 0; round < ROUNDS; round++)
+    for (int i = 0; i < KEY_COUNT; i++)
+      sink += tableGet(&table, keys[i], &value);
+  report("hit", (long)ROUNDS * KEY_COUNT, now() - start, false);
+
+  start = now();
+  for (int round = 0; round < ROUNDS; round++)
+    for (int i = 0; i < KEY_COUNT; i++)
+      sink += tableGet(&table, missing[i], &value);
+  report("miss", (long)ROUNDS * KEY_COUNT, now() - start, false);
+  reportProbes("full", &table);
+  freeTable(&table);
+
+  // a sliding window: every insert is followed by the delete
+  // of the key inserted WINDOW steps before
+  initTable(&table);
+  start = now();
+  for (int round = 0; round < ROUNDS; round++)
+    for (int i = 0; i < KEY_COUNT; i++)
+    {
+      tableSet(&table, keys[i], NIL_VAL);
+      tableDelete(&table, keys[(i + KEY_COUNT - WINDOW) % KEY_COUNT]);
+    }
+  report("delete-heavy", (long)ROUNDS * KEY_COUNT * 2, now() - start, false);
+  reportProbes("churned", &table);
+  freeTable(&table);
+
+  start = now();
+  for (int round = 0; round < ROUNDS; round++)
+    for (int i = 0; i < KEY_COUNT; i++)
+      sink += tableFindString(&vm->strings, keys[i]->chars, keys[i]->length, keys[i]->hash) != NULL;
+  report("intern", (long)ROUNDS * KEY_COUNT, now() - start, false);
+
+  start = now();
+  for (int round = 0; round < ROUNDS; round++)
+    for (int i = 0; i < KEY_COUNT; i++)
+      sink += hashString(keys[i]->chars, keys[i]->length);
+  report("hash-identifier", (long)ROUNDS * KEY_COUNT, now() - start, false);
+
+  // copyString() of a string that is interned already: hash,
+  // probe and compare the characters of the match
+  start = now();
+  for (int round = 0; round < ROUNDS; round++)
+    for (int i = 0; i < KEY_COUNT; i++)
+      sink += copyString(keys[i]->chars, keys[i]->length) == keys[i];
+  report("copy-identifier", (long)ROUNDS * KEY_COUNT, now() - start, false);
+
+  long longOps = (long)ROUNDS * KEY_COUNT / 16;
+  start = now();
+  for (long op = 0; op < longOps; op++)
+    sink += hashString(longKeys[op % LONG_COUNT]->chars, LONG_LENGTH);
+  report("hash-1k", longOps, now() - start, false);
+
+  start = now();
+  for (long op = 0; op < longOps; op++)
+  {
+    ObjString *key = longKeys[op % LONG_COUNT];
+    sink += copyString(key->chars, LONG_LENGTH) == key;
+  }
+  report("copy-1k", longOps, now() - start, true);
+  printf("]\n");
+
+  freeVM();
+  return 0;
+}
\ No newline at end of file
@@ -0,0 +1,409 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "memory.h"
+#include "vm.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HAS_MMAP
+#endif
+
+// Bytecode cache files (.loxc). A file is a header followed by the
+// names of the global slots and then the script function, written
+// depth first with the functions nested in its constants:
+//
+//   function: arity, upvalueCount, stackSlots, name
+//             count, code[count], lineCount, lines[lineCount]
+//             constantCount, constants
+//   constant: tag, then a number, a string or a function
+//   string:   length (NO_NAME for none), chars
+//
+// Every field is a 32-bit word or a run of bytes padded to 4, in
+// the byte order of the machine that wrote it. The file is mapped
+// privately and writable, so chunks point their code and lines
+// straight into it: quickening then only copies the pages it
+// touches. Constants hold pointers, so they are rebuilt as objects.
+//
+// The header carries the length and hash of the source, which is
+// how a stale cache is told apart, and the hash of the payload, so
+// a truncated or damaged file is never run. Global slots are baked
+// into the bytecode, the cache is only used when the names get the
+// same slots again.
+
+#define CACHE_MAGIC "LOXC"
+#define NO_NAME UINT32_MAX
+
+typedef enum
+{
+  CONSTANT_NUMBER,
+  CONSTANT_STRING,
+  CONSTANT_FUNCTION,
+} ConstantTag;
+
+typedef struct
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t sourceLength;
+  uint32_t payloadLength;
+  uint64_t sourceHash;
+  uint64_t payloadHash;
+} CacheHeader;
+
+typedef struct
+{
+  const uint8_t *current;
+  const uint8_t *end;
+  bool failed;
+} Reader;
+
+typedef struct
+{
+  uint8_t *bytes;
+  size_t count;
+  size_t capacity;
+  bool failed;
+} Writer;
+
+// loaded files, kept by the VM until closeCaches()
+typedef struct CacheMapping
+{
+  void *base;
+  size_t size;
+  bool mapped;
+} Mapping;
+
+static size_t padded(size_t size)
+{
+  return (size + 3) & ~(size_t)3;
+}
+// the next size bytes, or NULL past the end
+static const uint8_t *take(Reader *reader, size_t size)
+{
+  if (reader->failed || (size_t)(reader->end - reader->current) < padded(size))
+  {
+    reader->failed = true;
+    return NULL;
+  }
+  const uint8_t *bytes = reader->current;
+  reader->current += padded(size);
+  return bytes;
+}
+static uint32_t readWord(Reader *reader)
+{
+  uint32_t word = 0;
+  const uint8_t *bytes = take(reader, sizeof(word));
+  if (bytes != NULL)
+    memcpy(&word, bytes, sizeof(word));
+  return word;
+}
+static ObjString *readString(Reader *reader)
+{
+  uint32_t length = readWord(reader);
+  if (length == NO_NAME)
+    return NULL;
+  const uint8_t *chars = take(reader, length);
+  if (chars == NULL)
+    return NULL;
+  return copyString((const char *)chars, (int)length);
+}
+static ObjFunction *readFunction(Reader *reader)
+{
+  ObjFunction *function = newFunction();
+  // reachable while its name and constants are allocated
+  push(OBJ_VAL(function));
+  function->arity = (int)readWord(reader);
+  function->upvalueCount = (int)readWord(reader);
+  function->stackSlots = (int)readWord(reader);
+  function->name = readString(reader);
+  writeBarrier((Obj *)function, (Obj *)function->name);
+
+  uint32_t count = readWord(reader);
+  uint8_t *code = (uint8_t *)take(reader, count);
+  uint32_t lineCount = readWord(reader);
+  LineStart *lines = (LineStart *)take(reader, (size_t)lineCount * sizeof(LineStart));
+  if (code != NULL && lines != NULL)
+  {
+    function->chunk.code = code;
+    function->chunk.count = (int)count;
+    function->chunk.lines = lines;
+    function->chunk.lineCount = (int)lineCount;
+  }
+
+  uint32_t constantCount = readWord(reader);
+  for (uint32_t i = 0; i < constantCount && !reader->failed; i++)
+  {
+    Value value = NIL_VAL;
+    switch (readWord(reader))
+    {
+    case CONSTANT_NUMBER:
+    {
+      double number = 0;
+      const uint8_t *bytes = take(reader, sizeof(number));
+      if (bytes != NULL)
+        memcpy(&number, bytes, sizeof(number));
+      value = NUMBER_VAL(number);
+      break;
+    }
+    case CONSTANT_STRING:
+    {
+      ObjString *string = readString(reader);
+      if (string != NULL)
+        value = OBJ_VAL(string);
+      else
+        reader->failed = true;
+      break;
+    }
+    case CONSTANT_FUNCTION:
+    {
+      ObjFunction *nested = readFunction(reader);
+      if (nested != NULL)
+        value = OBJ_VAL(nested);
+      break;
+    }
+    default:
+      reader->failed = true;
+    }
+    addConstant(&function->chunk, value);
+    writeValueBarrier((Obj *)function, value);
+  }
+  pop();
+  return reader->failed ? NULL : function;
+}
+// maps the whole file, or reads it when mmap is not available
+static bool loadFile(const char *path, Mapping *mapping)
+{
+#ifdef HAS_MMAP
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(CacheHeader))
+  {
+    close(fd);
+    return false;
+  }
+  mapping->size = (size_t)info.st_size;
+  mapping->base = mmap(NULL, mapping->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  mapping->mapped = true;
+  return mapping->base != MAP_FAILED;
+#else
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+    return false;
+  fseek(file, 0L, SEEK_END);
+  long size = ftell(file);
+  rewind(file);
+  mapping->size = size > 0 ? (size_t)size : 0;
+  mapping->base = size >= (long)sizeof(CacheHeader) ? malloc(mapping->size) : NULL;
+  mapping->mapped = false;
+  bool read = mapping->base != NULL &&
+              fread(mapping->base, 1, mapping->size, file) == mapping->size;
+  fclose(file);
+  if (!read)
+    free(mapping->base);
+  return read;
+#endif
+}
+static void unloadFile(Mapping *mapping)
+{
+#ifdef HAS_MMAP
+  if (mapping->mapped)
+  {
+    munmap(mapping->base, mapping->size);
+    return;
+  }
+#endif
+  free(mapping->base);
+}
+ObjFunction *loadCache(const char *cachePath, const char *source)
+{
+  Mapping mapping;
+  if (!loadFile(cachePath, &mapping))
+    return NULL;
+  const CacheHeader *header = (const CacheHeader *)mapping.base;
+  size_t sourceLength = strlen(source);
+  const uint8_t *payload = (const uint8_t *)mapping.base + sizeof(CacheHeader);
+  if (memcmp(header->magic, CACHE_MAGIC, 4) != 0 || header->version != CACHE_VERSION ||
+      header->sourceLength != sourceLength ||
+      header->payloadLength != mapping.size - sizeof(CacheHeader) ||
+      header->sourceHash != hashBytes(source, (int)sourceLength) ||
+      header->payloadHash != hashBytes((const char *)payload, (int)header->payloadLength))
+  {
+    unloadFile(&mapping);
+    return NULL;
+  }
+
+  Reader reader = {payload, payload + header->payloadLength, false};
+  uint32_t globalCount = readWord(&reader);
+  for (uint32_t slot = 0; slot < globalCount && !reader.failed; slot++)
+  {
+    ObjString *name = readString(&reader);
+    if (name == NULL || globalSlot(name) != (int)slot)
+      reader.failed = true;
+  }
+  ObjFunction *function = reader.failed ? NULL : readFunction(&reader);
+  if (function == NULL)
+  {
+    // the functions read so far are garbage and
+    // nothing reads the code they point to
+    unloadFile(&mapping);
+    return NULL;
+  }
+  Mapping *mappings = realloc(vm->cacheMappings, sizeof(Mapping) * (vm->cacheMappingCount + 1));
+  if (mappings == NULL)
+    exit(1);
+  mappings[vm->cacheMappingCount++] = mapping;
+  vm->cacheMappings = mappings;
+  return function;
+}
+void closeCaches()
+{
+  for (int i = 0; i < vm->cacheMappingCount; i++)
+    unloadFile(&vm->cacheMappings[i]);
+  free(vm->cacheMappings);
+  vm->cacheMappings = NULL;
+  vm->cacheMappingCount = 0;
+}
+
+// the file is built in a malloc buffer,
+// writing it never starts a collection
+static void writeBytes(Writer *writer, const void *bytes, size_t size)
+{
+  size_t needed = writer->count + padded(size);
+  if (needed > writer->capacity)
+  {
+    size_t capacity = writer->capacity < 256 ? 256 : writer->capacity;
+    while (capacity < needed)
+      capacity *= 2;
+    uint8_t *grown = realloc(writer->bytes, capacity);
+    if (grown == NULL)
+    {
+      writer->failed = true;
+      return;
+    }
+    writer->bytes = grown;
+    writer->capacity = capacity;
+  }
+  if (writer->failed)
+    return;
+  memcpy(writer->bytes + writer->count, bytes, size);
+  memset(writer->bytes + writer->count + size, 0, padded(size) - size);
+  writer->count = needed;
+}
+static void writeWord(Writer *writer, uint32_t word)
+{
+  writeBytes(writer, &word, sizeof(word));
+}
+static void writeString(Writer *writer, ObjString *string)
+{
+  if (string == NULL)
+  {
+    writeWord(writer, NO_NAME);
+    return;
+  }
+  writeWord(writer, (uint32_t)string->length);
+  writeBytes(writer, string->chars, string->length);
+}
+static void writeFunction(Writer *writer, ObjFunction *function)
+{
+  writeWord(writer, (uint32_t)function->arity);
+  writeWord(writer, (uint32_t)function->upvalueCount);
+  writeWord(writer, (uint32_t)function->stackSlots);
+  writeString(writer, function->name);
+
+  Chunk *chunk = &function->chunk;
+  writeWord(writer, (uint32_t)chunk->count);
+  writeBytes(writer, chunk->code, chunk->count);
+  writeWord(writer, (uint32_t)chunk->lineCount);
+  writeBytes(writer, chunk->lines, (size_t)chunk->lineCount * sizeof(LineStart));
+
+  writeWord(writer, (uint32_t)chunk->constants.count);
+  for (int i = 0; i < chunk->constants.count; i++)
+  {
+    Value value = chunk->constants.values[i];
+    if (IS_NUMBER(value))
+    {
+      double number = AS_NUMBER(value);
+      writeWord(writer, CONSTANT_NUMBER);
+      writeBytes(writer, &number, sizeof(number));
+    }
+    else if (IS_STRING(value))
+    {
+      writeWord(writer, CONSTANT_STRING);
+      writeString(writer, AS_STRING(value));
+    }
+    else if (IS_FUNCTION(value))
+    {
+      writeWord(writer, CONSTANT_FUNCTION);
+      writeFunction(writer, AS_FUNCTION(value));
+    }
+    else
+    {
+      // the compiler makes no other constants
+      writer->failed = true;
+    }
+  }
+}
+void writeCache(const char *cachePath, const char *source, ObjFunction *function)
+{
+  Writer writer = {NULL, 0, 0, false};
+  CacheHeader header;
+  memset(&header, 0, sizeof(header));
+  writeBytes(&writer, &header, sizeof(header));
+
+  // global names in slot order
+  int globalCount = vm->globalValues.count;
+  ObjString **names = calloc(globalCount + 1, sizeof(ObjString *));
+  for (int i = 0; i < vm->globalNames.capacity && names != NULL; i++)
+  {
+    Entry *entry = &vm->globalNames.entries[i];
+    if (entry->key != NULL)
+      names[(int)AS_NUMBER(entry->value)] = entry->key;
+  }
+  writeWord(&writer, (uint32_t)globalCount);
+  for (int slot = 0; slot < globalCount && names != NULL; slot++)
+    writeString(&writer, names[slot]);
+  free(names);
+  writeFunction(&writer, function);
+
+  if (names == NULL || writer.failed)
+  {
+    free(writer.bytes);
+    return;
+  }
+  size_t sourceLength = strlen(source);
+  const uint8_t *payload = writer.bytes + sizeof(header);
+  memcpy(header.magic, CACHE_MAGIC, 4);
+  header.version = CACHE_VERSION;
+  header.sourceLength = (uint32_t)sourceLength;
+  header.payloadLength = (uint32_t)(writer.count - sizeof(header));
+  header.sourceHash = hashBytes(source, (int)sourceLength);
+  header.payloadHash = hashBytes((const char *)payload, (int)header.payloadLength);
+  memcpy(writer.bytes, &header, sizeof(header));
+
+  // written under a temporary name and renamed, so a
+  // reader never sees a partly written file
+  char tempPath[4096];
+#ifdef HAS_MMAP
+  snprintf(tempPath, sizeof(tempPath), "%s.%d.tmp", cachePath, (int)getpid());
+#else
+  snprintf(tempPath, sizeof(tempPath), "%s.tmp", cachePath);
+#endif
+  FILE *file = fopen(tempPath, "wb");
+  if (file != NULL)
+  {
+    bool written = fwrite(writer.bytes, 1, writer.count, file) == writer.count;
+    written = fclose(file) == 0 && written;
+    if (!written || rename(tempPath, cachePath) != 0)
+      remove(tempPath);
+  }
+  free(writer.bytes);
+}
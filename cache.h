@@ -0,0 +1,22 @@
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "common.h"
+#include "object.h"
+
+// bump whenever the opcodes, the compiler's output
+// or the layout of cache files change
+#define CACHE_VERSION 4
+
+// the compiled script of source if cachePath holds a fresh cache
+// for it, else NULL. The file stays mapped until closeCaches()
+// or until the current VM is freed
+ObjFunction *loadCache(const char *cachePath, const char *source);
+// saves the compiled script of source, silently giving
+// up when the file cannot be written
+void writeCache(const char *cachePath, const char *source, ObjFunction *function);
+// unmaps every cache file loaded by the current VM,
+// for when no function loaded from one will run again
+void closeCaches();
+
+#endif
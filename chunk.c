@@ -2,20 +2,28 @@
 
 #include "chunk.h"
 #include "memory.h"
+#include "vm.h"
 
 void initChunk(Chunk *chunk)
 {
   chunk->count = 0;
   chunk->capacity = 0;
   chunk->code = NULL;
+  chunk->lineCount = 0;
+  chunk->lineCapacity = 0;
   chunk->lines = NULL;
   initValueArray(&chunk->constants);
 }
 
 void freeChunk(Chunk *chunk)
 {
-  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
+  // a chunk loaded from a cache file borrows its code and
+  // lines from the file's mapping
+  if (chunk->capacity > 0)
+  {
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+  }
   freeValueArray(&chunk->constants);
   initChunk(chunk);
 }
@@ -27,18 +35,125 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line)
     int oldCapacity = chunk->capacity;
     chunk->capacity = GROW_CAPACITY(oldCapacity);
     chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-    chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
   }
   chunk->code[chunk->count] = byte;
-  chunk->lines[chunk->count] = line;
+  if (chunk->lineCount == 0 || chunk->lines[chunk->lineCount - 1].line != line)
+  {
+    if (chunk->lineCapacity < chunk->lineCount + 1)
+    {
+      int oldCapacity = chunk->lineCapacity;
+      chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+      chunk->lines = GROW_ARRAY(LineStart, chunk->lines, oldCapacity, chunk->lineCapacity);
+    }
+    LineStart *start = &chunk->lines[chunk->lineCount++];
+    start->offset = chunk->count;
+    start->line = line;
+  }
   chunk->count++;
 }
+// line of the instruction at offset, a binary
+// search for the last run starting at or before it
+int getLine(const Chunk *chunk, int offset)
+{
+  int low = 0;
+  int high = chunk->lineCount - 1;
+  while (low < high)
+  {
+    int middle = low + (high - low + 1) / 2;
+    if (chunk->lines[middle].offset <= offset)
+      low = middle;
+    else
+      high = middle - 1;
+  }
+  return chunk->lineCount > 0 ? chunk->lines[low].line : 0;
+}
 /**
  * Returns the index where the constant
  * was added
  */
 int addConstant(Chunk *chunk, Value value)
 {
+  // growing the array can collect, so the value
+  // is kept on the stack until it is stored
+  push(value);
   writeValueArray(&chunk->constants, value);
+  pop();
   return chunk->constants.count - 1;
+}
+// size in bytes of the instruction at offset,
+// including its operands
+int instructionLength(const Chunk *chunk, int offset)
+{
+  switch (chunk->code[offset])
+  {
+  case OP_CONSTANT:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_GET_CAPTURED:
+  case OP_CALL:
+    return 2;
+  case OP_GET_GLOBAL:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_LOOP:
+  case OP_ADD_LOCALS:
+  case OP_JUMP_IF_FALSE_POP:
+  case OP_JUMP_IF_NOT_LESS:
+  case OP_JUMP_IF_NOT_GREATER:
+    return 3;
+  case OP_CONSTANT_LONG:
+    return 4;
+  case OP_CLOSURE:
+  {
+    // followed by an (isLocal, index) pair per upvalue
+    ObjFunction *function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+    return 2 + 2 * function->upvalueCount;
+  }
+  case OP_CLOSURE_LONG:
+  {
+    int constant = longOperand(&chunk->code[offset + 1]);
+    ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+    return 4 + 2 * function->upvalueCount;
+  }
+  default:
+    return 1;
+  }
+}
+// upper bound on the stack slots the chunk uses above its
+// callee and arguments. No instruction grows the stack by more
+// than its count here, and the compiler leaves the stack
+// balanced around loops, so the sum over the code is enough
+int stackSlots(const Chunk *chunk)
+{
+  int slots = 0;
+  for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+  {
+    switch (chunk->code[offset])
+    {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_GET_CAPTURED:
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG:
+      slots += 1;
+      break;
+    case OP_ADD_LOCALS:
+      // pushes both operands when falling back to OP_ADD
+      slots += 2;
+      break;
+    default:
+      break;
+    }
+  }
+  return slots;
 }
\ No newline at end of file
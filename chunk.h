@@ -35,20 +35,74 @@ typedef enum
   OP_CLOSURE,
   OP_CLOSE_UPVALUE,
   OP_RETURN,
+  // forms with a 24-bit constant index, for
+  // constants past the first 256 of a chunk
+  OP_CONSTANT_LONG,
+  OP_CLOSURE_LONG,
+  // reads an upvalue captured by value, the compiler rewrites
+  // OP_GET_UPVALUE into it for variables never assigned
+  OP_GET_CAPTURED,
+  // superinstructions, only produced by the optimizer
+  OP_NOT_EQUAL,
+  OP_GREATER_EQUAL,
+  OP_LESS_EQUAL,
+  OP_ADD_LOCALS,
+  OP_JUMP_IF_FALSE_POP,
+  OP_JUMP_IF_NOT_LESS,
+  OP_JUMP_IF_NOT_GREATER,
+  // quickened forms, rewritten in place at run time
+  OP_ADD_NUM,
+  OP_LESS_NUM,
+  OP_GREATER_NUM,
 } OpCode;
 
+// the first byte of each (capture, index) operand pair of
+// OP_CLOSURE: index is an upvalue of the enclosing closure,
+// a local of the enclosing frame, or a local whose value
+// is copied because it is never assigned
+typedef enum
+{
+  CAPTURE_UPVALUE,
+  CAPTURE_LOCAL,
+  CAPTURE_VALUE,
+} CaptureKind;
+
+// constant operands are one byte, or three in the _LONG forms
+#define CONSTANTS_MAX (1 << 24)
+static inline int longOperand(const uint8_t *operand)
+{
+  return (operand[0] << 16) | (operand[1] << 8) | operand[2];
+}
+
+// the bytecode from offset up to the next LineStart
+// was compiled from line
+typedef struct
+{
+  int offset;
+  int line;
+} LineStart;
+
 typedef struct
 {
   int count;
+  // 0 with code set when code and lines point into
+  // a mapped cache file instead of owned arrays
   int capacity;
   uint8_t *code;
-  int *lines; // linenumber of every bytecode instruction in original source code
+  // line numbers run-length encoded, one entry per change
+  // of line, only read on error and debugging paths
+  int lineCount;
+  int lineCapacity;
+  LineStart *lines;
   ValueArray constants;
 } Chunk;
 
 void initChunk(Chunk *chunk);
 void freeChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
+int getLine(const Chunk *chunk, int offset);
 int addConstant(Chunk *chunk, Value value);
+int instructionLength(const Chunk *chunk, int offset);
+int stackSlots(const Chunk *chunk);
 
 #endif
\ No newline at end of file
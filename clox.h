@@ -0,0 +1,89 @@
+#ifndef clox_h
+#define clox_h
+
+#include <stdbool.h>
+
+// The embedding API of libclox. A host creates any number of
+// VMs and drives each one through a stack of values, like Lua:
+// calls take their callee and arguments from the top of the
+// stack and leave their result in their place. A VM is not
+// thread-safe, give each thread its own.
+//
+// Stack indexes from 0 count from the first argument of the
+// running native (from the bottom outside of natives), negative
+// ones count from the top, so -1 is the top value.
+
+#if defined(__GNUC__)
+#define LOX_API __attribute__((visibility("default")))
+#else
+#define LOX_API
+#endif
+
+typedef struct VM LoxVM;
+
+typedef enum
+{
+  LOX_OK,
+  LOX_COMPILE_ERROR,
+  LOX_RUNTIME_ERROR
+} LoxResult;
+
+// a native sees its argCount arguments from index 0. It returns
+// false after loxError(), else true, its result being the value
+// it pushed last, or nil when it pushed nothing
+typedef bool (*LoxNative)(LoxVM *vm, int argCount);
+
+LOX_API LoxVM *loxNewVM();
+LOX_API void loxFreeVM(LoxVM *vm);
+
+// compiles and runs a script
+LOX_API LoxResult loxInterpret(LoxVM *vm, const char *source);
+// compiles a script and pushes it as a function of no arguments
+LOX_API LoxResult loxLoad(LoxVM *vm, const char *source);
+// calls the value below the argCount values on top of the stack.
+// On an error both are popped and nothing is pushed
+LOX_API LoxResult loxCall(LoxVM *vm, int argCount);
+// defines a global native function
+LOX_API void loxRegister(LoxVM *vm, const char *name, LoxNative function, int arity);
+// reports a runtime error from a native, for "return loxError(...)"
+LOX_API bool loxError(LoxVM *vm, const char *format, ...);
+// threads that collections of large heaps may use, by default
+// one per processor up to 8. 1 keeps the collector on the VM's thread
+LOX_API void loxSetGCThreads(LoxVM *vm, int threads);
+// makes major collections incremental, in steps of about this many
+// microseconds between allocations. 0, the default, collects in
+// one pause
+LOX_API void loxSetGCPause(LoxVM *vm, int micros);
+// calls nested deeper than this are a stack overflow, 1M by default
+LOX_API void loxSetMaxFrames(LoxVM *vm, int frames);
+// compiles hot functions to machine code, off by default.
+// Builds without the compiler ignore it
+LOX_API void loxSetJit(LoxVM *vm, bool enabled);
+
+// pushes the value of a global, false
+// without pushing if it is not defined
+LOX_API bool loxGetGlobal(LoxVM *vm, const char *name);
+// pops the top value into a global
+LOX_API void loxSetGlobal(LoxVM *vm, const char *name);
+
+// the index of the top value plus one
+LOX_API int loxGetTop(LoxVM *vm);
+LOX_API void loxPop(LoxVM *vm, int count);
+LOX_API void loxPushNil(LoxVM *vm);
+LOX_API void loxPushBool(LoxVM *vm, bool value);
+LOX_API void loxPushNumber(LoxVM *vm, double value);
+LOX_API void loxPushString(LoxVM *vm, const char *chars, int length);
+
+LOX_API bool loxIsNil(LoxVM *vm, int index);
+LOX_API bool loxIsBool(LoxVM *vm, int index);
+LOX_API bool loxIsNumber(LoxVM *vm, int index);
+LOX_API bool loxIsString(LoxVM *vm, int index);
+// false only for nil and false, like Lox conditions
+LOX_API bool loxToBool(LoxVM *vm, int index);
+// 0 if the value is not a number
+LOX_API double loxToNumber(LoxVM *vm, int index);
+// the characters of a string, valid while the value stays on
+// the stack, NULL if the value is not a string
+LOX_API const char *loxToString(LoxVM *vm, int index, int *length);
+
+#endif
@@ -8,6 +8,61 @@
 // #define DEBUG_PRINT_CODE
 // #define DEBUG_TRACE_EXECUTION
 
+// collect garbage on every allocation, to shake out
+// objects that are missing from the root set
+// #define DEBUG_STRESS_GC
+// #define DEBUG_LOG_GC
+
+// threaded dispatch in run() using the labels-as-values
+// extension. Comment out to use the portable switch instead.
+#define COMPUTED_GOTO
+#if defined(COMPUTED_GOTO) && !defined(__GNUC__)
+#undef COMPUTED_GOTO
+#endif
+
+// pack every Value into one 64-bit word instead of
+// the tagged union. Comment out to use the tagged union.
+#define NAN_BOXING
+
+// serve heap objects from size-class pools instead of one
+// malloc each. Comment out to let tools like ASan see every object.
+#define POOL_ALLOCATOR
+
+// mark and sweep major collections of large heaps on several
+// threads. Comment out for a single-threaded collector.
+#define PARALLEL_GC
+#if defined(PARALLEL_GC) && \
+    !(defined(__GNUC__) && (defined(__unix__) || defined(__APPLE__)))
+#undef PARALLEL_GC
+#endif
+
+// compile hot functions to x86-64 machine code when asked to with
+// --jit. Comment out to leave only the interpreter.
+#define JIT
+#if defined(JIT) && !(defined(__GNUC__) && defined(__x86_64__) && \
+                      defined(__linux__) && defined(NAN_BOXING))
+#undef JIT
+#endif
+
+// Robin Hood linear probing with backward-shift deletion
+// for Table instead of SwissTable-style groups
+// #define TABLE_ROBIN_HOOD
+
+// keeps rarely taken slow paths out of the hot code they are called from
+#ifdef __GNUC__
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
+
+// state of the running VM and compiler is per thread,
+// so every thread can run VMs of its own
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
 #define UINT8_COUNT (UINT8_MAX + 1)
 void debugLog(const char *format, ...);
 
@@ -5,6 +5,8 @@
 #include "common.h"
 #include "compiler.h"
 #include "vm.h"
+#include "memory.h"
+#include "optimizer.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
@@ -51,6 +53,11 @@ typedef struct
   Token name;
   int depth;
   bool isCaptured;
+  // set by any assignment after the declaration. A captured
+  // local that is never assigned is captured by value
+  bool isAssigned;
+  // where the code of the local's scope starts in the chunk
+  int start;
 } Local;
 typedef struct
 {
@@ -62,6 +69,13 @@ typedef enum
   TYPE_FUNCTION,
   TYPE_SCRIPT,
 } FunctionType;
+// where a number or string literal already is in the
+// constant pool, index -1 marks an empty slot
+typedef struct
+{
+  Value value;
+  int index;
+} ConstantSlot;
 typedef struct Compiler
 {
   // the function in which this compiler was created
@@ -75,10 +89,17 @@ typedef struct Compiler
   int localCount;
   Upvalue upvalues[UINT8_COUNT];
   int scopeDepth;
+  // open addressing set of the literals in the chunk,
+  // so each is only added to its constants once
+  ConstantSlot *constantSlots;
+  int constantSlotCount;
+  int constantSlotCapacity;
 } Compiler;
 
-Parser parser;
-Compiler *current = NULL;
+// per thread, compile() runs to completion without
+// running any Lox code
+THREAD_LOCAL Parser parser;
+THREAD_LOCAL Compiler *current = NULL;
 // Chunk *compilingChunk;
 static Chunk *currentChunk()
 {
@@ -161,6 +182,13 @@ static void emitBytes(uint8_t byte1, uint8_t byte2)
   emitByte(byte1);
   emitByte(byte2);
 }
+// global instructions take a 16-bit slot operand
+static void emitGlobal(uint8_t instruction, int slot)
+{
+  emitByte(instruction);
+  emitByte((slot >> 8) & 0xff);
+  emitByte(slot & 0xff);
+}
 static void emitLoop(int loopStart)
 {
   emitByte(OP_LOOP);
@@ -195,19 +223,100 @@ static void emitReturn()
   emitByte(OP_NIL);
   emitByte(OP_RETURN);
 }
-static uint8_t makeConstant(Value value)
+// numbers are told apart by their bits, so 0 and -0 stay
+// two constants, and strings by address as they are interned
+static uint64_t constantBits(Value value)
+{
+  if (IS_NUMBER(value))
+  {
+    double number = AS_NUMBER(value);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    return bits;
+  }
+  return (uint64_t)(uintptr_t)AS_OBJ(value);
+}
+static ConstantSlot *findConstantSlot(ConstantSlot *slots, int capacity, Value value)
+{
+  uint64_t bits = constantBits(value);
+  uint32_t index = (uint32_t)((bits * 0x9e3779b97f4a7c15ull) >> 32) & (capacity - 1);
+  for (;;)
+  {
+    ConstantSlot *slot = &slots[index];
+    if (slot->index == -1 ||
+        (IS_NUMBER(slot->value) == IS_NUMBER(value) && constantBits(slot->value) == bits))
+      return slot;
+    index = (index + 1) & (capacity - 1);
+  }
+}
+static void growConstantSlots()
+{
+  int capacity = GROW_CAPACITY(current->constantSlotCapacity);
+  ConstantSlot *slots = ALLOCATE(ConstantSlot, capacity);
+  for (int i = 0; i < capacity; i++)
+    slots[i].index = -1;
+  for (int i = 0; i < current->constantSlotCapacity; i++)
+  {
+    ConstantSlot *old = &current->constantSlots[i];
+    if (old->index != -1)
+      *findConstantSlot(slots, capacity, old->value) = *old;
+  }
+  FREE_ARRAY(ConstantSlot, current->constantSlots, current->constantSlotCapacity);
+  current->constantSlots = slots;
+  current->constantSlotCapacity = capacity;
+}
+// index of value in the chunk's constants, literals that
+// are there already are not added again
+static int makeConstant(Value value)
 {
+  bool isLiteral = IS_NUMBER(value) || IS_STRING(value);
+  if (isLiteral && current->constantSlotCount > 0)
+  {
+    ConstantSlot *slot = findConstantSlot(current->constantSlots,
+                                          current->constantSlotCapacity, value);
+    if (slot->index != -1)
+      return slot->index;
+  }
   int constant = addConstant(currentChunk(), value);
-  if (constant > UINT8_MAX)
+  // the function may be old by now, it was allocated
+  // before everything it is being compiled with
+  writeValueBarrier((Obj *)current->function, value);
+  if (constant >= CONSTANTS_MAX)
   {
     error("Too many constants in one chunk");
     return 0;
   }
-  return (uint8_t)constant;
+  if (isLiteral)
+  {
+    // the value is in the constants already, so growing
+    // the set may collect without losing it
+    if (current->constantSlotCount + 1 > current->constantSlotCapacity * 3 / 4)
+      growConstantSlots();
+    ConstantSlot *slot = findConstantSlot(current->constantSlots,
+                                          current->constantSlotCapacity, value);
+    slot->value = value;
+    slot->index = constant;
+    current->constantSlotCount++;
+  }
+  return constant;
+}
+// the first 256 constants take a one byte operand,
+// the rest the three byte one of the long form
+static void emitConstantInstruction(uint8_t instruction, uint8_t longInstruction, int constant)
+{
+  if (constant <= UINT8_MAX)
+  {
+    emitBytes(instruction, (uint8_t)constant);
+    return;
+  }
+  emitByte(longInstruction);
+  emitByte((constant >> 16) & 0xff);
+  emitByte((constant >> 8) & 0xff);
+  emitByte(constant & 0xff);
 }
 static void emitConstant(Value value)
 {
-  emitBytes(OP_CONSTANT, makeConstant(value));
+  emitConstantInstruction(OP_CONSTANT, OP_CONSTANT_LONG, makeConstant(value));
 }
 ////Compiler methods
 static void initCompiler(Compiler *compiler, FunctionType type)
@@ -219,25 +328,42 @@ static void initCompiler(Compiler *compiler, FunctionType type)
   compiler->type = type;
   compiler->localCount = 0;
   compiler->scopeDepth = 0;
+  compiler->constantSlots = NULL;
+  compiler->constantSlotCount = 0;
+  compiler->constantSlotCapacity = 0;
   compiler->function = newFunction();
   current = compiler;
   // get the function name
   if (type != TYPE_SCRIPT)
   {
     current->function->name = copyString(parser.previous.start, parser.previous.length);
+    writeBarrier((Obj *)current->function, (Obj *)current->function->name);
   }
 
   // Compiler claims the first local variable slot
   Local *local = &current->locals[current->localCount++];
   local->depth = 0;
   local->isCaptured = false;
+  local->isAssigned = false;
+  local->start = 0;
   local->name.start = "";
   local->name.length = 0;
 }
+static void captureByValue(int local);
 static ObjFunction *endCompiler()
 {
+  // the locals of the function's outermost scope
+  for (int i = 1; i < current->localCount; i++)
+  {
+    if (current->locals[i].isCaptured && !current->locals[i].isAssigned)
+      captureByValue(i);
+  }
   emitReturn();
   ObjFunction *function = current->function;
+  if (!parser.hadError)
+    optimizeChunk(currentChunk());
+  function->stackSlots = stackSlots(currentChunk());
+  FREE_ARRAY(ConstantSlot, current->constantSlots, current->constantSlotCapacity);
 
 #ifdef DEBUG_PRINT_CODE
   // print
@@ -262,7 +388,14 @@ static void endScope()
   while (current->localCount > 0 && current->locals[current->localCount - 1].depth > current->scopeDepth)
   {
     // emitByte(OP_POP);
-    if (current->locals[current->localCount - 1].isCaptured)
+    Local *local = &current->locals[current->localCount - 1];
+    if (local->isCaptured && !local->isAssigned)
+    {
+      // the closures copied the value, there is no upvalue to close
+      captureByValue(current->localCount - 1);
+      emitByte(OP_POP);
+    }
+    else if (local->isCaptured)
     {
       emitByte(OP_CLOSE_UPVALUE);
     }
@@ -280,9 +413,17 @@ static void declaration();
 static ParseRule *getRule(TokenType type);
 static void parsePrecedence(Precedence p);
 
-static uint8_t identifierConstant(Token *name)
+// globals are resolved to their slot in vm->globalValues
+// at compile time, so the VM never looks up names
+static int identifierGlobal(Token *name)
 {
-  return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+  int slot = globalSlot(copyString(name->start, name->length));
+  if (slot >= GLOBALS_MAX)
+  {
+    error("Too many global variables.");
+    return 0;
+  }
+  return slot;
 }
 static bool identifiersEqual(Token *a, Token *b)
 {
@@ -330,6 +471,76 @@ static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal)
   compiler->upvalues[upvalueCount].index = index;
   return compiler->function->upvalueCount++;
 }
+// the function an OP_CLOSURE or OP_CLOSURE_LONG at offset makes a
+// closure of, its (capture, index) pairs start at *pairs
+static ObjFunction *closureOperands(Chunk *chunk, int offset, int *pairs)
+{
+  if (chunk->code[offset] == OP_CLOSURE)
+  {
+    *pairs = offset + 2;
+    return AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+  }
+  *pairs = offset + 4;
+  return AS_FUNCTION(chunk->constants.values[longOperand(&chunk->code[offset + 1])]);
+}
+// upvalue of function holds a value, not an ObjUpvalue. Its reads
+// become OP_GET_CAPTURED, in the closures function makes as well
+static void readCapturedValue(ObjFunction *function, int upvalue)
+{
+  Chunk *chunk = &function->chunk;
+  for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+  {
+    uint8_t instruction = chunk->code[offset];
+    if (instruction == OP_GET_UPVALUE && chunk->code[offset + 1] == upvalue)
+    {
+      chunk->code[offset] = OP_GET_CAPTURED;
+    }
+    else if (instruction == OP_CLOSURE || instruction == OP_CLOSURE_LONG)
+    {
+      int pairs;
+      ObjFunction *inner = closureOperands(chunk, offset, &pairs);
+      for (int i = 0; i < inner->upvalueCount; i++)
+      {
+        if (chunk->code[pairs + 2 * i] == CAPTURE_UPVALUE && chunk->code[pairs + 2 * i + 1] == upvalue)
+          readCapturedValue(inner, i);
+      }
+    }
+  }
+}
+// called when the scope of a captured local that was never assigned
+// ends. Every closure made in the scope copies the local's value,
+// which cannot change any more, instead of capturing the variable
+static void captureByValue(int local)
+{
+  if (parser.hadError)
+    return;
+  Chunk *chunk = currentChunk();
+  for (int offset = current->locals[local].start; offset < chunk->count; offset += instructionLength(chunk, offset))
+  {
+    if (chunk->code[offset] != OP_CLOSURE && chunk->code[offset] != OP_CLOSURE_LONG)
+      continue;
+    int pairs;
+    ObjFunction *inner = closureOperands(chunk, offset, &pairs);
+    for (int i = 0; i < inner->upvalueCount; i++)
+    {
+      if (chunk->code[pairs + 2 * i] == CAPTURE_LOCAL && chunk->code[pairs + 2 * i + 1] == local)
+      {
+        chunk->code[pairs + 2 * i] = CAPTURE_VALUE;
+        readCapturedValue(inner, i);
+      }
+    }
+  }
+}
+// an assignment through an upvalue makes the
+// local it captures in the end assigned
+static void markUpvalueAssigned(Compiler *compiler, int upvalue)
+{
+  Upvalue *captured = &compiler->upvalues[upvalue];
+  if (captured->isLocal)
+    compiler->enclosing->locals[captured->index].isAssigned = true;
+  else
+    markUpvalueAssigned(compiler->enclosing, captured->index);
+}
 static int resolveUpvalue(Compiler *compiler, Token *name)
 {
   if (compiler->enclosing == NULL)
@@ -360,6 +571,8 @@ static void addLocal(Token name)
   local->name = name;
   local->depth = -1; // current->scopeDepth;
   local->isCaptured = false;
+  local->isAssigned = false;
+  local->start = currentChunk()->count;
 }
 static void declareVariable()
 {
@@ -382,14 +595,14 @@ static void declareVariable()
   }
   addLocal(*name);
 }
-static uint8_t parseVariable(const char *errorMessage)
+static int parseVariable(const char *errorMessage)
 {
   consume(TOKEN_IDENTIFIER, errorMessage);
   declareVariable();
   // exit if this is a local scope
   if (current->scopeDepth > 0)
     return 0;
-  return identifierConstant(&parser.previous);
+  return identifierGlobal(&parser.previous);
 }
 static void markInitialized()
 {
@@ -398,14 +611,14 @@ static void markInitialized()
     return;
   current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
-static void defineVariable(uint8_t global)
+static void defineVariable(int global)
 {
   if (current->scopeDepth > 0)
   {
     markInitialized();
     return;
   }
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  emitGlobal(OP_DEFINE_GLOBAL, global);
 }
 static uint8_t argumentList()
 {
@@ -554,7 +767,7 @@ static void namedVariable(Token name, bool canAssign)
   else
   {
     // global var
-    arg = identifierConstant(&name);
+    arg = identifierGlobal(&name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
   }
@@ -562,8 +775,17 @@ static void namedVariable(Token name, bool canAssign)
   {
     // means it is an assignment statement
     expression(); // compile the following expression
-    emitBytes(setOp, (uint8_t)arg);
+    if (setOp == OP_SET_LOCAL)
+      current->locals[arg].isAssigned = true;
+    else if (setOp == OP_SET_UPVALUE)
+      markUpvalueAssigned(current, arg);
+    if (setOp == OP_SET_GLOBAL)
+      emitGlobal(setOp, arg);
+    else
+      emitBytes(setOp, (uint8_t)arg);
   }
+  else if (getOp == OP_GET_GLOBAL)
+    emitGlobal(getOp, arg);
   else
     emitBytes(getOp, (uint8_t)arg);
 }
@@ -697,7 +919,7 @@ static void function(FunctionType type)
       {
         errorAtCurrent("Too many parameters (255+)");
       }
-      uint8_t constant = parseVariable("Expected parameter name");
+      int constant = parseVariable("Expected parameter name");
       defineVariable(constant);
     } while (match(TOKEN_COMMA));
   }
@@ -709,23 +931,25 @@ static void function(FunctionType type)
   }
   ObjFunction *function = endCompiler();
   // emitBytes(OP_CONSTANT, makeConstant(OBJ_VAL(function)));
-  emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+  emitConstantInstruction(OP_CLOSURE, OP_CLOSURE_LONG, makeConstant(OBJ_VAL(function)));
   for (int i = 0; i < function->upvalueCount; i++)
   {
-    emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
+    // CAPTURE_LOCAL turns into CAPTURE_VALUE when the
+    // scope of the local ends without assigning it
+    emitByte(compiler.upvalues[i].isLocal ? CAPTURE_LOCAL : CAPTURE_UPVALUE);
     emitByte(compiler.upvalues[i].index);
   }
 }
 static void funDeclaration()
 {
-  uint8_t global = parseVariable("Expected function name after 'fun'");
+  int global = parseVariable("Expected function name after 'fun'");
   markInitialized();
   function(TYPE_FUNCTION);
   defineVariable(global);
 }
 static void varDeclaration()
 {
-  uint8_t global = parseVariable("Expected variable name");
+  int global = parseVariable("Expected variable name");
   if (match(TOKEN_EQUAL))
   {
     expression();
@@ -926,6 +1150,17 @@ static ParseRule *getRule(TokenType type)
 {
   return &rules[type];
 }
+// the functions being compiled are only reachable
+// through the chain of compilers
+void markCompilerRoots()
+{
+  Compiler *compiler = current;
+  while (compiler != NULL)
+  {
+    markObject((Obj *)compiler->function);
+    compiler = compiler->enclosing;
+  }
+}
 ////// Grammar code ends
 ObjFunction *compile(const char *source)
 {
@@ -3,6 +3,7 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 void disassembleChunk(const Chunk *chunk, const char *name)
 {
@@ -32,6 +33,24 @@ static int jumpInstruction(const char *name, int sign, const Chunk *chunk, int o
   printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
   return offset + 3;
 }
+// OP_ADD_LOCALS _slot_a _slot_b
+static int twoByteInstruction(const char *name, const Chunk *chunk, int offset)
+{
+  printf("%-16s %4d %4d\n", name, chunk->code[offset + 1], chunk->code[offset + 2]);
+  return offset + 3;
+}
+/**
+ * This is OP_GET_GLOBAL _slot_hi _slot_lo
+ * Ex. OP_GET_GLOBAL 3 'count'
+ */
+static int globalInstruction(const char *name, const Chunk *chunk, int offset)
+{
+  uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+  slot |= chunk->code[offset + 2];
+  ObjString *global = globalName(slot);
+  printf("%-16s %4d '%s'\n", name, slot, global != NULL ? global->chars : "?");
+  return offset + 3;
+}
 /**
  * This is OP_CONSTANT _constant_index
  * Ex. OP_CONSTANT 0
@@ -44,22 +63,34 @@ static int constantInstruction(char *name, const Chunk *chunk, int offset)
   printf("\n");
   return offset + 2;
 }
+// OP_CONSTANT_LONG _index_hi _index_mid _index_lo
+static int constantLongInstruction(char *name, const Chunk *chunk, int offset)
+{
+  int constant = longOperand(&chunk->code[offset + 1]);
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("\n");
+  return offset + 4;
+}
 int disassembleInstruction(const Chunk *chunk, int offset)
 {
   printf("%04d ", offset);
-  if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1])
+  int line = getLine(chunk, offset);
+  if (offset > 0 && line == getLine(chunk, offset - 1))
   {
     printf("   | ");
   }
   else
   {
-    printf("%4d ", chunk->lines[offset]);
+    printf("%4d ", line);
   }
   uint8_t instruction = chunk->code[offset];
   switch (instruction)
   {
   case OP_CONSTANT:
     return constantInstruction("OP_CONSTANT", chunk, offset);
+  case OP_CONSTANT_LONG:
+    return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
   case OP_NIL:
     return simpleInstruction("OP_NIL", offset);
   case OP_TRUE:
@@ -73,15 +104,17 @@ int disassembleInstruction(const Chunk *chunk, int offset)
   case OP_SET_LOCAL:
     return byteInstruction("OP_SET_LOCAL", chunk, offset);
   case OP_GET_GLOBAL:
-    return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+    return globalInstruction("OP_GET_GLOBAL", chunk, offset);
   case OP_DEFINE_GLOBAL:
-    return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+    return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
   case OP_SET_GLOBAL:
-    return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+    return globalInstruction("OP_SET_GLOBAL", chunk, offset);
   case OP_GET_UPVALUE:
     return byteInstruction("OP_GET_UPVALUE", chunk, offset);
   case OP_SET_UPVALUE:
     return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+  case OP_GET_CAPTURED:
+    return byteInstruction("OP_GET_CAPTURED", chunk, offset);
   case OP_EQUAL:
     return simpleInstruction("OP_EQUAL", offset);
   case OP_GREATER:
@@ -111,19 +144,23 @@ int disassembleInstruction(const Chunk *chunk, int offset)
   case OP_CALL:
     return byteInstruction("OP_CALL", chunk, offset);
   case OP_CLOSURE:
+  case OP_CLOSURE_LONG:
   {
+    bool isLong = instruction == OP_CLOSURE_LONG;
     offset++;
-    uint8_t constant = chunk->code[offset++];
-    printf("%-16s %4d ", "OP_CLOSURE", constant);
+    int constant = isLong ? longOperand(&chunk->code[offset]) : chunk->code[offset];
+    offset += isLong ? 3 : 1;
+    printf("%-16s %4d ", isLong ? "OP_CLOSURE_LONG" : "OP_CLOSURE", constant);
     printValue(chunk->constants.values[constant]);
     printf("\n");
     ObjFunction *function = AS_FUNCTION(
         chunk->constants.values[constant]);
     for (int j = 0; j < function->upvalueCount; j++)
     {
-      int isLocal = chunk->code[offset++];
+      int capture = chunk->code[offset++];
       int index = chunk->code[offset++];
-      printf("%04d    |             %s %d\n", offset - 2, isLocal ? "local" : "upvalue", index);
+      const char *kind = capture == CAPTURE_VALUE ? "value" : capture == CAPTURE_LOCAL ? "local" : "upvalue";
+      printf("%04d    |             %s %d\n", offset - 2, kind, index);
     }
     return offset;
   }
@@ -133,6 +170,26 @@ int disassembleInstruction(const Chunk *chunk, int offset)
     return simpleInstruction("OP_RETURN", offset);
   case OP_NO_OP:
     return simpleInstruction("OP_NO_OP", offset);
+  case OP_NOT_EQUAL:
+    return simpleInstruction("OP_NOT_EQUAL", offset);
+  case OP_GREATER_EQUAL:
+    return simpleInstruction("OP_GREATER_EQUAL", offset);
+  case OP_LESS_EQUAL:
+    return simpleInstruction("OP_LESS_EQUAL", offset);
+  case OP_ADD_LOCALS:
+    return twoByteInstruction("OP_ADD_LOCALS", chunk, offset);
+  case OP_JUMP_IF_FALSE_POP:
+    return jumpInstruction("OP_JUMP_IF_FALSE_POP", 1, chunk, offset);
+  case OP_JUMP_IF_NOT_LESS:
+    return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+  case OP_JUMP_IF_NOT_GREATER:
+    return jumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+  case OP_ADD_NUM:
+    return simpleInstruction("OP_ADD_NUM", offset);
+  case OP_LESS_NUM:
+    return simpleInstruction("OP_LESS_NUM", offset);
+  case OP_GREATER_NUM:
+    return simpleInstruction("OP_GREATER_NUM", offset);
   default:
     printf("Unknown opcode %d\n", instruction);
     return offset + 1;
@@ -0,0 +1,675 @@
+#include "jit.h"
+
+#ifdef JIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "chunk.h"
+#include "profiler.h"
+
+// A baseline compiler: each instruction of a hot function becomes a
+// fixed template of x86-64 code, and the templates are laid out one
+// after the other. The values stay in the VM's stack exactly where the
+// interpreter keeps them, only the top of the stack lives in a register
+// while the code runs. So every instruction the templates do not cover
+// (calls, returns, closures, printing, strings, errors) just stores
+// frame->ip and leaves to the interpreter, which runs it and enters the
+// code again at the next call, return or back-edge. The code never
+// allocates, so it never collects and never raises an error itself.
+
+typedef enum
+{
+  RAX,
+  RCX,
+  RDX,
+  RBX,
+  RSP,
+  RBP,
+  RSI,
+  RDI,
+  R8,
+  R9,
+  R10,
+  R11,
+  R12,
+  R13,
+  R14,
+  R15,
+} Register;
+
+// held by the compiled code from entry to exit
+#define VM_REGISTER RBX
+#define TOP_REGISTER R12
+#define SLOTS_REGISTER R13
+#define FRAME_REGISTER R14
+#define QNAN_REGISTER R15
+
+// condition codes of jcc and setcc
+#define CONDITION_E 0x4
+#define CONDITION_NE 0x5
+#define CONDITION_BE 0x6
+#define CONDITION_A 0x7
+#define CONDITION_ALWAYS -1
+
+// a rel32 filled in once every instruction has its code: the
+// start of the instruction at target, or the exit leaving it
+// to the interpreter when toExit is set
+typedef struct
+{
+  int position;
+  int target;
+  bool toExit;
+} Patch;
+
+typedef struct
+{
+  const Chunk *chunk;
+  uint8_t *code;
+  int count;
+  int capacity;
+  int *entries;
+  // the code storing frame->ip and returning to the interpreter
+  int exit;
+  Patch *patches;
+  int patchCount;
+  int patchCapacity;
+} Assembler;
+
+static void emitByte(Assembler *as, uint8_t byte)
+{
+  if (as->count == as->capacity)
+  {
+    as->capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+    as->code = (uint8_t *)realloc(as->code, as->capacity);
+    if (as->code == NULL)
+      exit(1);
+  }
+  as->code[as->count++] = byte;
+}
+static void emitBytes(Assembler *as, const uint8_t *bytes, int count)
+{
+  for (int i = 0; i < count; i++)
+    emitByte(as, bytes[i]);
+}
+#define EMIT(...) \
+  emitBytes(as, (const uint8_t[]){__VA_ARGS__}, sizeof((const uint8_t[]){__VA_ARGS__}))
+static void emitInt32(Assembler *as, int32_t value)
+{
+  uint8_t bytes[4];
+  memcpy(bytes, &value, 4);
+  emitBytes(as, bytes, 4);
+}
+static void emitInt64(Assembler *as, uint64_t value)
+{
+  uint8_t bytes[8];
+  memcpy(bytes, &value, 8);
+  emitBytes(as, bytes, 8);
+}
+static void patchInt32(Assembler *as, int position, int32_t value)
+{
+  memcpy(as->code + position, &value, 4);
+}
+
+// the ModRM byte (and SIB, for RSP and R12) of [base + disp]
+static void emitAddress(Assembler *as, int reg, int base, int32_t disp)
+{
+  bool disp8 = disp >= INT8_MIN && disp <= INT8_MAX;
+  emitByte(as, (disp8 ? 0x40 : 0x80) | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP)
+    emitByte(as, 0x24);
+  if (disp8)
+    emitByte(as, (uint8_t)disp);
+  else
+    emitInt32(as, disp);
+}
+// a 64-bit instruction between reg and [base + disp]
+static void emitMemory(Assembler *as, uint8_t opcode, int reg, int base, int32_t disp)
+{
+  emitByte(as, 0x48 | ((reg & 8) >> 1) | ((base & 8) >> 3));
+  emitByte(as, opcode);
+  emitAddress(as, reg, base, disp);
+}
+static void emitLoad(Assembler *as, int reg, int base, int32_t disp)
+{
+  emitMemory(as, 0x8B, reg, base, disp);
+}
+static void emitStore(Assembler *as, int base, int32_t disp, int reg)
+{
+  emitMemory(as, 0x89, reg, base, disp);
+}
+// opcode dst, src for the two-register forms
+// of mov, add, or, and, xor and cmp
+static void emitRegisters(Assembler *as, uint8_t opcode, int dst, int src)
+{
+  emitByte(as, 0x48 | ((src & 8) >> 1) | ((dst & 8) >> 3));
+  emitByte(as, opcode);
+  emitByte(as, 0xC0 | ((src & 7) << 3) | (dst & 7));
+}
+#define MOV 0x89
+#define OR 0x09
+#define AND 0x21
+#define XOR 0x31
+#define CMP 0x39
+static void emitMoveImmediate(Assembler *as, int reg, uint64_t value)
+{
+  emitByte(as, 0x48 | ((reg & 8) >> 3));
+  emitByte(as, 0xB8 + (reg & 7));
+  emitInt64(as, value);
+}
+// add or sub of a small constant
+static void emitAdd(Assembler *as, int reg, int8_t value)
+{
+  emitByte(as, 0x48 | ((reg & 8) >> 3));
+  emitByte(as, 0x83);
+  emitByte(as, (value < 0 ? 0xE8 : 0xC0) | (reg & 7));
+  emitByte(as, (uint8_t)(value < 0 ? -value : value));
+}
+// a scalar double instruction between xmm and [base + disp]
+static void emitDouble(Assembler *as, uint8_t prefix, uint8_t opcode,
+                       int xmm, int base, int32_t disp)
+{
+  emitByte(as, prefix);
+  if (base & 8)
+    emitByte(as, 0x41);
+  emitByte(as, 0x0F);
+  emitByte(as, opcode);
+  emitAddress(as, xmm, base, disp);
+}
+#define MOVQ_LOAD 0xF3, 0x7E
+#define MOVQ_STORE 0x66, 0xD6
+#define UCOMISD 0x66, 0x2E
+#define ADDSD 0xF2, 0x58
+#define MULSD 0xF2, 0x59
+#define SUBSD 0xF2, 0x5C
+#define DIVSD 0xF2, 0x5E
+
+// jumps and their targets
+static void addPatch(Assembler *as, int target, bool toExit)
+{
+  if (as->patchCount == as->patchCapacity)
+  {
+    as->patchCapacity = as->patchCapacity < 16 ? 16 : as->patchCapacity * 2;
+    as->patches = (Patch *)realloc(as->patches, sizeof(Patch) * as->patchCapacity);
+    if (as->patches == NULL)
+      exit(1);
+  }
+  as->patches[as->patchCount++] = (Patch){as->count, target, toExit};
+}
+static void emitJumpOpcode(Assembler *as, int condition)
+{
+  if (condition == CONDITION_ALWAYS)
+    emitByte(as, 0xE9);
+  else
+    EMIT(0x0F, 0x80 | condition);
+}
+// to the instruction at the bytecode offset target
+static void emitJump(Assembler *as, int condition, int target)
+{
+  emitJumpOpcode(as, condition);
+  addPatch(as, target, false);
+  emitInt32(as, 0);
+}
+// to the interpreter, which runs the instruction at offset
+static void emitExitJump(Assembler *as, int condition, int offset)
+{
+  emitJumpOpcode(as, condition);
+  addPatch(as, offset, true);
+  emitInt32(as, 0);
+}
+static void emitExit(Assembler *as, int offset)
+{
+  emitMoveImmediate(as, RAX, (uint64_t)(uintptr_t)(as->chunk->code + offset));
+  emitByte(as, 0xE9);
+  emitInt32(as, as->exit - (as->count + 4));
+}
+// a jump forward inside the template, landed by landJump()
+static int emitLocalJump(Assembler *as, int condition)
+{
+  emitJumpOpcode(as, condition);
+  emitInt32(as, 0);
+  return as->count - 4;
+}
+static void landJump(Assembler *as, int position)
+{
+  patchInt32(as, position, as->count - (position + 4));
+}
+
+static void emitPush(Assembler *as, int reg)
+{
+  emitStore(as, TOP_REGISTER, 0, reg);
+  emitAdd(as, TOP_REGISTER, 8);
+}
+static void emitPeek(Assembler *as, int reg, int distance)
+{
+  emitLoad(as, reg, TOP_REGISTER, -8 * (distance + 1));
+}
+// leaves when the value in reg is not a number, clobbers RCX
+static void emitNumberGuard(Assembler *as, int reg, int offset)
+{
+  emitRegisters(as, MOV, RCX, reg);
+  emitRegisters(as, AND, RCX, QNAN_REGISTER);
+  emitRegisters(as, CMP, RCX, QNAN_REGISTER);
+  emitExitJump(as, CONDITION_E, offset);
+}
+// leaves when the value in reg is an object: storing one needs a
+// write barrier, storing over one snapshotBarrier(). Clobbers RCX
+// and RSI
+static void emitObjectGuard(Assembler *as, int reg, int offset)
+{
+  emitMoveImmediate(as, RSI, QNAN | SIGN_BIT);
+  emitRegisters(as, MOV, RCX, reg);
+  emitRegisters(as, AND, RCX, RSI);
+  emitRegisters(as, CMP, RCX, RSI);
+  emitExitJump(as, CONDITION_E, offset);
+}
+static void emitNumberOperands(Assembler *as, int offset)
+{
+  emitPeek(as, RAX, 1);
+  emitNumberGuard(as, RAX, offset);
+  emitPeek(as, RDX, 0);
+  emitNumberGuard(as, RDX, offset);
+}
+// jumps to target when the value in reg is nil or false
+static void emitFalseyJump(Assembler *as, int reg, int target)
+{
+  emitMoveImmediate(as, RCX, NIL_VAL);
+  emitRegisters(as, CMP, reg, RCX);
+  emitJump(as, CONDITION_E, target);
+  emitMoveImmediate(as, RCX, FALSE_VAL);
+  emitRegisters(as, CMP, reg, RCX);
+  emitJump(as, CONDITION_E, target);
+}
+// replaces the two operands with the bool in AL, the rest of RAX is 0
+static void emitBoolResult(Assembler *as)
+{
+  emitMoveImmediate(as, RCX, FALSE_VAL);
+  emitRegisters(as, OR, RAX, RCX);
+  emitStore(as, TOP_REGISTER, -16, RAX);
+  emitAdd(as, TOP_REGISTER, -8);
+}
+static void emitArithmetic(Assembler *as, uint8_t prefix, uint8_t opcode, int offset)
+{
+  emitNumberOperands(as, offset);
+  emitDouble(as, MOVQ_LOAD, 0, TOP_REGISTER, -16);
+  emitDouble(as, prefix, opcode, 0, TOP_REGISTER, -8);
+  emitDouble(as, MOVQ_STORE, 0, TOP_REGISTER, -16);
+  emitAdd(as, TOP_REGISTER, -8);
+}
+// compares the operands with ucomisd, the second one first when
+// swapped, and sets AL from the flags with setcc
+static void emitComparison(Assembler *as, bool swapped, int condition, int offset)
+{
+  emitNumberOperands(as, offset);
+  emitDouble(as, MOVQ_LOAD, 0, TOP_REGISTER, swapped ? -8 : -16);
+  EMIT(0x31, 0xC0); // xor eax, eax
+  emitDouble(as, UCOMISD, 0, TOP_REGISTER, swapped ? -16 : -8);
+  EMIT(0x0F, 0x90 | condition, 0xC0);
+  emitBoolResult(as);
+}
+// numbers compare as doubles, so NaN is not equal to itself. Other
+// values are equal when their bits are, apart from two different
+// objects, which may be a rope and a string of the same text
+static void emitEquality(Assembler *as, bool negated, int offset)
+{
+  emitPeek(as, RAX, 1);
+  emitPeek(as, RDX, 0);
+  emitRegisters(as, MOV, RCX, RAX);
+  emitRegisters(as, AND, RCX, QNAN_REGISTER);
+  emitRegisters(as, CMP, RCX, QNAN_REGISTER);
+  int firstNotNumber = emitLocalJump(as, CONDITION_E);
+  emitRegisters(as, MOV, RCX, RDX);
+  emitRegisters(as, AND, RCX, QNAN_REGISTER);
+  emitRegisters(as, CMP, RCX, QNAN_REGISTER);
+  int secondNotNumber = emitLocalJump(as, CONDITION_E);
+  // two numbers: equal when ZF is set and PF, unordered, is not
+  emitDouble(as, MOVQ_LOAD, 0, TOP_REGISTER, -16);
+  EMIT(0x31, 0xC0);       // xor eax, eax
+  emitDouble(as, UCOMISD, 0, TOP_REGISTER, -8);
+  EMIT(0x0F, 0x94, 0xC0,  // sete al
+       0x0F, 0x9B, 0xC1,  // setnp cl
+       0x20, 0xC8);       // and al, cl
+  int numbersDone = emitLocalJump(as, CONDITION_ALWAYS);
+  landJump(as, firstNotNumber);
+  landJump(as, secondNotNumber);
+  emitRegisters(as, CMP, RAX, RDX);
+  int same = emitLocalJump(as, CONDITION_E);
+  emitRegisters(as, AND, RAX, RDX);
+  emitObjectGuard(as, RAX, offset);
+  EMIT(0x31, 0xC0); // xor eax, eax
+  int differentDone = emitLocalJump(as, CONDITION_ALWAYS);
+  landJump(as, same);
+  EMIT(0xB8, 0x01, 0x00, 0x00, 0x00); // mov eax, 1
+  landJump(as, numbersDone);
+  landJump(as, differentDone);
+  if (negated)
+    EMIT(0x83, 0xF0, 0x01); // xor eax, 1
+  emitBoolResult(as);
+}
+// pops two numbers and jumps to target when the
+// comparison set up like emitComparison() is false
+static void emitCompareJump(Assembler *as, bool swapped, int target, int offset)
+{
+  emitNumberOperands(as, offset);
+  emitDouble(as, MOVQ_LOAD, swapped ? 1 : 0, TOP_REGISTER, -16);
+  emitDouble(as, MOVQ_LOAD, swapped ? 0 : 1, TOP_REGISTER, -8);
+  emitAdd(as, TOP_REGISTER, -16);
+  EMIT(0x66, 0x0F, 0x2E, 0xC1); // ucomisd xmm0, xmm1
+  emitJump(as, CONDITION_BE, target);
+}
+// the value of upvalue slot of the frame's closure into reg
+static void emitUpvalue(Assembler *as, int reg, int slot)
+{
+  emitLoad(as, reg, FRAME_REGISTER, offsetof(CallFrame, upvalues));
+  emitLoad(as, reg, reg, 8 * slot);
+}
+// the variable an ObjUpvalue in reg points to into reg
+static void emitUpvalueLocation(Assembler *as, int reg)
+{
+  emitMoveImmediate(as, RCX, ~(SIGN_BIT | QNAN));
+  emitRegisters(as, AND, reg, RCX);
+  emitLoad(as, reg, reg, offsetof(ObjUpvalue, location));
+}
+
+// the jump offset or global slot after the opcode
+static int shortOperand(const uint8_t *code)
+{
+  return (code[1] << 8) | code[2];
+}
+
+static void emitInstruction(Assembler *as, int offset)
+{
+  const uint8_t *code = as->chunk->code + offset;
+  int next = offset + instructionLength(as->chunk, offset);
+  switch (code[0])
+  {
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG:
+  {
+    int constant = code[0] == OP_CONSTANT ? code[1] : longOperand(code + 1);
+    emitMoveImmediate(as, RAX, as->chunk->constants.values[constant]);
+    emitPush(as, RAX);
+    break;
+  }
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+    emitMoveImmediate(as, RAX, code[0] == OP_NIL ? NIL_VAL : BOOL_VAL(code[0] == OP_TRUE));
+    emitPush(as, RAX);
+    break;
+  case OP_POP:
+    emitAdd(as, TOP_REGISTER, -8);
+    break;
+  case OP_GET_LOCAL:
+    emitLoad(as, RAX, SLOTS_REGISTER, 8 * code[1]);
+    emitPush(as, RAX);
+    break;
+  case OP_SET_LOCAL:
+    emitPeek(as, RAX, 0);
+    emitStore(as, SLOTS_REGISTER, 8 * code[1], RAX);
+    break;
+  // the array of globals moves when it grows, so it is loaded every time
+  case OP_GET_GLOBAL:
+    emitLoad(as, RCX, VM_REGISTER, offsetof(VM, globalValues.values));
+    emitLoad(as, RAX, RCX, 8 * shortOperand(code));
+    emitMoveImmediate(as, RDX, UNDEFINED_VAL);
+    emitRegisters(as, CMP, RAX, RDX);
+    emitExitJump(as, CONDITION_E, offset);
+    emitPush(as, RAX);
+    break;
+  case OP_SET_GLOBAL:
+    emitLoad(as, RDX, VM_REGISTER, offsetof(VM, globalValues.values));
+    emitLoad(as, RAX, RDX, 8 * shortOperand(code));
+    emitMoveImmediate(as, RCX, UNDEFINED_VAL);
+    emitRegisters(as, CMP, RAX, RCX);
+    emitExitJump(as, CONDITION_E, offset);
+    // storing over an object needs snapshotBarrier()
+    emitObjectGuard(as, RAX, offset);
+    emitPeek(as, RAX, 0);
+    emitObjectGuard(as, RAX, offset);
+    emitStore(as, RDX, 8 * shortOperand(code), RAX);
+    break;
+  case OP_GET_UPVALUE:
+    emitUpvalue(as, RAX, code[1]);
+    emitUpvalueLocation(as, RAX);
+    emitLoad(as, RAX, RAX, 0);
+    emitPush(as, RAX);
+    break;
+  case OP_GET_CAPTURED:
+    emitUpvalue(as, RAX, code[1]);
+    emitPush(as, RAX);
+    break;
+  case OP_SET_UPVALUE:
+    emitPeek(as, RAX, 0);
+    emitObjectGuard(as, RAX, offset);
+    emitUpvalue(as, RDX, code[1]);
+    emitUpvalueLocation(as, RDX);
+    emitLoad(as, RDI, RDX, 0);
+    emitObjectGuard(as, RDI, offset);
+    emitStore(as, RDX, 0, RAX);
+    break;
+  case OP_EQUAL:
+  case OP_NOT_EQUAL:
+    emitEquality(as, code[0] == OP_NOT_EQUAL, offset);
+    break;
+  // the negated comparisons are false for NaN like OP_LESS/OP_GREATER
+  case OP_GREATER:
+  case OP_GREATER_NUM:
+    emitComparison(as, false, CONDITION_A, offset);
+    break;
+  case OP_LESS:
+  case OP_LESS_NUM:
+    emitComparison(as, true, CONDITION_A, offset);
+    break;
+  case OP_GREATER_EQUAL:
+    emitComparison(as, true, CONDITION_BE, offset);
+    break;
+  case OP_LESS_EQUAL:
+    emitComparison(as, false, CONDITION_BE, offset);
+    break;
+  // strings are added by the interpreter
+  case OP_ADD:
+  case OP_ADD_NUM:
+    emitArithmetic(as, ADDSD, offset);
+    break;
+  case OP_SUBTRACT:
+    emitArithmetic(as, SUBSD, offset);
+    break;
+  case OP_MULTIPLY:
+    emitArithmetic(as, MULSD, offset);
+    break;
+  case OP_DIVIDE:
+    emitArithmetic(as, DIVSD, offset);
+    break;
+  case OP_ADD_LOCALS:
+    emitLoad(as, RAX, SLOTS_REGISTER, 8 * code[1]);
+    emitNumberGuard(as, RAX, offset);
+    emitLoad(as, RDX, SLOTS_REGISTER, 8 * code[2]);
+    emitNumberGuard(as, RDX, offset);
+    emitDouble(as, MOVQ_LOAD, 0, SLOTS_REGISTER, 8 * code[1]);
+    emitDouble(as, ADDSD, 0, SLOTS_REGISTER, 8 * code[2]);
+    emitDouble(as, MOVQ_STORE, 0, TOP_REGISTER, 0);
+    emitAdd(as, TOP_REGISTER, 8);
+    break;
+  case OP_NOT:
+    emitPeek(as, RAX, 0);
+    emitMoveImmediate(as, RCX, NIL_VAL);
+    emitRegisters(as, CMP, RAX, RCX);
+    EMIT(0x0F, 0x94, 0xC2); // sete dl
+    emitMoveImmediate(as, RCX, FALSE_VAL);
+    emitRegisters(as, CMP, RAX, RCX);
+    EMIT(0x0F, 0x94, 0xC0,  // sete al
+         0x08, 0xD0,        // or al, dl
+         0x0F, 0xB6, 0xC0); // movzx eax, al
+    emitRegisters(as, OR, RAX, RCX);
+    emitStore(as, TOP_REGISTER, -8, RAX);
+    break;
+  case OP_NEGATE:
+    emitPeek(as, RAX, 0);
+    emitNumberGuard(as, RAX, offset);
+    emitMoveImmediate(as, RCX, SIGN_BIT);
+    emitRegisters(as, XOR, RAX, RCX);
+    emitStore(as, TOP_REGISTER, -8, RAX);
+    break;
+  case OP_JUMP:
+    emitJump(as, CONDITION_ALWAYS, next + shortOperand(code));
+    break;
+  case OP_JUMP_IF_FALSE:
+    emitPeek(as, RAX, 0);
+    emitFalseyJump(as, RAX, next + shortOperand(code));
+    break;
+  case OP_JUMP_IF_FALSE_POP:
+    emitPeek(as, RAX, 0);
+    emitAdd(as, TOP_REGISTER, -8);
+    emitFalseyJump(as, RAX, next + shortOperand(code));
+    break;
+  case OP_JUMP_IF_NOT_LESS:
+    emitCompareJump(as, true, next + shortOperand(code), offset);
+    break;
+  case OP_JUMP_IF_NOT_GREATER:
+    emitCompareJump(as, false, next + shortOperand(code), offset);
+    break;
+  // a due profiler sample is taken by the interpreter's OP_LOOP
+  case OP_LOOP:
+    emitMoveImmediate(as, RAX, (uint64_t)(uintptr_t)&profileSampleDue);
+    EMIT(0x83, 0x38, 0x00); // cmp dword [rax], 0
+    emitExitJump(as, CONDITION_NE, offset);
+    emitJump(as, CONDITION_ALWAYS, next - shortOperand(code));
+    break;
+  case OP_NO_OP:
+    break;
+  // calls and returns change frames, the rest may allocate
+  default:
+    emitExit(as, offset);
+    break;
+  }
+}
+
+// rdi is the VM, rsi the frame and rdx the code to start at
+static void emitEntryAndExit(Assembler *as)
+{
+  EMIT(0x53,        // push rbx
+       0x41, 0x54,  // push r12
+       0x41, 0x55,  // push r13
+       0x41, 0x56,  // push r14
+       0x41, 0x57); // push r15
+  emitRegisters(as, MOV, VM_REGISTER, RDI);
+  emitRegisters(as, MOV, FRAME_REGISTER, RSI);
+  emitLoad(as, TOP_REGISTER, VM_REGISTER, offsetof(VM, stackTop));
+  emitLoad(as, SLOTS_REGISTER, FRAME_REGISTER, offsetof(CallFrame, slots));
+  emitMoveImmediate(as, QNAN_REGISTER, QNAN);
+  EMIT(0xFF, 0xE2); // jmp rdx
+  // rax is the instruction to continue at
+  as->exit = as->count;
+  emitStore(as, FRAME_REGISTER, offsetof(CallFrame, ip), RAX);
+  emitStore(as, VM_REGISTER, offsetof(VM, stackTop), TOP_REGISTER);
+  EMIT(0x41, 0x5F,  // pop r15
+       0x41, 0x5E,  // pop r14
+       0x41, 0x5D,  // pop r13
+       0x41, 0x5C,  // pop r12
+       0x5B,        // pop rbx
+       0xC3);       // ret
+}
+
+// fills in the jumps, with one exit for every
+// instruction that may leave to the interpreter
+static void patchJumps(Assembler *as)
+{
+  int *exits = (int *)malloc(sizeof(int) * as->chunk->count);
+  if (exits == NULL)
+    exit(1);
+  for (int i = 0; i < as->chunk->count; i++)
+    exits[i] = -1;
+  for (int i = 0; i < as->patchCount; i++)
+  {
+    Patch *patch = &as->patches[i];
+    int destination = as->entries[patch->target];
+    if (patch->toExit)
+    {
+      if (exits[patch->target] < 0)
+      {
+        exits[patch->target] = as->count;
+        emitExit(as, patch->target);
+      }
+      destination = exits[patch->target];
+    }
+    patchInt32(as, patch->position, destination - (patch->position + 4));
+  }
+  free(exits);
+}
+
+// lets perf name the code of the function in its profiles
+static void writePerfMap(JitCode *jit, int length, ObjFunction *function)
+{
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+  FILE *file = fopen(path, "a");
+  if (file == NULL)
+    return;
+  fprintf(file, "%lx %x lox:%s\n", (unsigned long)(uintptr_t)jit->code, length,
+          function->name != NULL ? function->name->chars : "script");
+  fclose(file);
+}
+
+void jitCompile(ObjFunction *function)
+{
+  Assembler as = {0};
+  as.chunk = &function->chunk;
+  as.entries = (int *)malloc(sizeof(int) * function->chunk.count);
+  if (as.entries == NULL)
+    exit(1);
+  for (int i = 0; i < function->chunk.count; i++)
+    as.entries[i] = -1;
+
+  emitEntryAndExit(&as);
+  for (int offset = 0; offset < function->chunk.count;
+       offset += instructionLength(&function->chunk, offset))
+  {
+    as.entries[offset] = as.count;
+    emitInstruction(&as, offset);
+  }
+  patchJumps(&as);
+  free(as.patches);
+
+  // written and then made executable, never both at once
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t size = (as.count + page - 1) / page * page;
+  void *code = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED)
+  {
+    free(as.code);
+    free(as.entries);
+    return;
+  }
+  memcpy(code, as.code, as.count);
+  free(as.code);
+  if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0)
+  {
+    munmap(code, size);
+    free(as.entries);
+    return;
+  }
+
+  JitCode *jit = (JitCode *)malloc(sizeof(JitCode));
+  if (jit == NULL)
+    exit(1);
+  jit->code = (uint8_t *)code;
+  jit->size = size;
+  jit->entries = as.entries;
+  function->jitCode = jit;
+  if (vm->perfMap)
+    writePerfMap(jit, as.count, function);
+}
+
+void jitFree(JitCode *jit)
+{
+  munmap(jit->code, jit->size);
+  free(jit->entries);
+  free(jit);
+}
+
+#endif
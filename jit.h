@@ -0,0 +1,52 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef JIT
+// calls, returns and back-edges of a function before it is compiled
+#define JIT_THRESHOLD 1000
+
+// the machine code of a function. Values stay in the VM's stack,
+// so it can leave any instruction to the interpreter and be
+// entered again at any instruction
+typedef struct JitCode
+{
+  // starts with the entry and exit code shared by every instruction
+  uint8_t *code;
+  size_t size;
+  // offset in code of the instruction at each bytecode
+  // offset, -1 for the operands
+  int *entries;
+} JitCode;
+
+typedef void (*JitFunction)(VM *vm, CallFrame *frame, uint8_t *entry);
+
+// leaves function->jitCode NULL if the code can not be mapped
+void jitCompile(ObjFunction *function);
+void jitFree(JitCode *jit);
+
+// counts towards compiling the running function and runs its code,
+// if it has some, from frame->ip. It comes back with frame->ip at
+// the first instruction left to the interpreter
+static inline void jitEnter(VM *vm, CallFrame *frame)
+{
+  ObjFunction *function = frame->function;
+  if (function->jitCode == NULL)
+  {
+    if (function->hotness >= JIT_THRESHOLD || ++function->hotness < JIT_THRESHOLD)
+      return;
+    jitCompile(function);
+    if (function->jitCode == NULL)
+      return;
+  }
+  JitCode *jit = function->jitCode;
+  int entry = jit->entries[frame->ip - function->chunk.code];
+  if (entry >= 0)
+    ((JitFunction)(void *)jit->code)(vm, frame, jit->code + entry);
+}
+#endif
+
+#endif
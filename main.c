@@ -3,12 +3,20 @@
 #include <string.h>
 
 #include "common.h"
+#include "cache.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
 #include "value.h"
 #include "vm.h"
 #include "table.h"
 #include "object.h"
+#include "memory.h"
+#include "pool.h"
+#include "profiler.h"
+
+// CPU time between two profiler samples
+#define PROFILE_INTERVAL_US 1000
 
 static void testTables();
 static void repl()
@@ -55,10 +63,40 @@ static char *readFile(const char *path)
   fclose(file);
   return buffer;
 }
-static void runFile(const char *path)
+// script.lox is cached in script.loxc, other names get .loxc appended
+static char *cachePathFor(const char *path)
+{
+  size_t length = strlen(path);
+  char *cachePath = (char *)malloc(length + 6);
+  if (cachePath == NULL)
+    return NULL;
+  if (length >= 4 && strcmp(path + length - 4, ".lox") == 0)
+    sprintf(cachePath, "%sc", path);
+  else
+    sprintf(cachePath, "%s.loxc", path);
+  return cachePath;
+}
+static void runFile(const char *path, const char *profilePath, bool poolStats, bool gcStats, bool useCache)
 {
   char *source = readFile(path);
-  InterpretResult result = interpret(source);
+  if (profilePath != NULL && !startProfiler(PROFILE_INTERVAL_US))
+    profilePath = NULL;
+  char *cachePath = useCache ? cachePathFor(path) : NULL;
+  ObjFunction *function = cachePath != NULL ? loadCache(cachePath, source) : NULL;
+  if (function == NULL)
+  {
+    function = compile(source);
+    if (function != NULL && cachePath != NULL)
+      writeCache(cachePath, source, function);
+  }
+  free(cachePath);
+  InterpretResult result = function != NULL ? interpretFunction(function) : INTERPRET_COMPILE_ERROR;
+  if (profilePath != NULL)
+    stopProfiler(profilePath);
+  if (poolStats)
+    printPoolStats(&vm->pools, stderr);
+  if (gcStats)
+    printGCStats(stderr);
   free(source);
   if (result == INTERPRET_COMPILE_ERROR)
     exit(65);
@@ -70,19 +108,55 @@ int main(int argc, const char *argv[])
 {
   // testTables();
   // return 0;
-  initVM();
+  newVM();
 
-  if (argc == 1)
+  const char *profilePath = NULL;
+  bool poolStats = false;
+  bool gcStats = false;
+  bool useCache = true;
+  int arg = 1;
+  for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++)
+  {
+    // --profile or --profile=<output file>
+    if (strcmp(argv[arg], "--profile") == 0)
+      profilePath = "clox.folded";
+    else if (strncmp(argv[arg], "--profile=", 10) == 0)
+      profilePath = argv[arg] + 10;
+    else if (strcmp(argv[arg], "--pool-stats") == 0)
+      poolStats = true;
+    else if (strcmp(argv[arg], "--gc-stats") == 0)
+      gcStats = true;
+    else if (strcmp(argv[arg], "--no-cache") == 0)
+      useCache = false;
+    else if (strncmp(argv[arg], "--gc-threads=", 13) == 0)
+      vm->gcThreads = atoi(argv[arg] + 13) > 0 ? atoi(argv[arg] + 13) : 1;
+    else if (strncmp(argv[arg], "--gc-pause=", 11) == 0)
+      vm->gcPauseMicros = atoi(argv[arg] + 11) > 0 ? atoi(argv[arg] + 11) : 0;
+    else if (strncmp(argv[arg], "--max-frames=", 13) == 0)
+      vm->framesMax = atoi(argv[arg] + 13) > 0 ? atoi(argv[arg] + 13) : 1;
+    else if (strcmp(argv[arg], "--jit") == 0)
+      vm->jitEnabled = true;
+    // the map only names compiled code, so it turns the compiler on
+    else if (strcmp(argv[arg], "--perf-map") == 0)
+      vm->jitEnabled = vm->perfMap = true;
+    else
+      break;
+  }
+  if (arg == argc && profilePath == NULL)
   {
     repl();
+    if (poolStats)
+      printPoolStats(&vm->pools, stderr);
+    if (gcStats)
+      printGCStats(stderr);
   }
-  else if (argc == 2)
+  else if (arg == argc - 1)
   {
-    runFile(argv[1]);
+    runFile(argv[arg], profilePath, poolStats, gcStats, useCache);
   }
   else
   {
-    fprintf(stderr, "Usage: ./clox [path]\n");
+    fprintf(stderr, "Usage: ./clox [--profile[=out.folded]] [--pool-stats] [--gc-stats] [--no-cache] [--gc-threads=n] [--gc-pause=us] [--max-frames=n] [--jit] [--perf-map] [path]\n");
     exit(64);
   }
   freeVM();
@@ -93,8 +167,8 @@ static void testTables()
 {
   Table table;
   initTable(&table);
-  ObjString *o1 = takeString("a", 1);
-  ObjString *o2 = takeString("b", 1);
+  ObjString *o1 = copyString("a", 1);
+  ObjString *o2 = copyString("b", 1);
   tableSet(&table, o1, NIL_VAL);
   Value v;
   printf("\n%d", tableGet(&table, o1, &v));
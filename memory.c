@@ -1,10 +1,174 @@
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "compiler.h"
+#include "jit.h"
 #include "memory.h"
+#include "pool.h"
 #include "vm.h"
-// we can count bytes being used by this function
-// since all memory allocations go through here
+#include "workers.h"
+
+#ifdef DEBUG_LOG_GC
+#include <stdio.h>
+#include "debug.h"
+#endif
+
+// Generational collection. New objects go to the nursery, the
+// vm->youngObjects list, and the survivors of their first collection
+// are promoted to vm->objects. Most objects die young, so minor
+// collections, run after every NURSERY_SIZE bytes of allocation,
+// only mark and sweep the nursery: every old object is taken as
+// reachable and not traced, except the ones in the remembered set.
+// Write barriers add an old object to it when a reference to a young
+// object is stored into it, and mark the card of a global written a
+// young object. A major collection marks and sweeps everything once
+// the heap grew GC_HEAP_GROW_FACTOR times its size after the last one.
+//
+// Objects never move, C code holds pointers to them across
+// allocations, so promotion is moving the object to an old list.
+//
+// With PARALLEL_GC, major collections of heaps of PARALLEL_GC_MIN_HEAP
+// bytes or more use vm->gcThreads threads. The roots are marked as
+// usual and dealt out to the work-stealing deques of the threads,
+// which trace from there. Marking an object is an atomic exchange of
+// its mark, so only the thread that wins traces it. The threads then
+// take the old lists one at a time to sweep. The blocks they free
+// are kept aside and handed back to the pools afterwards. Dead
+// functions are freed afterwards too, their chunks are allocated
+// through reallocate().
+//
+// With vm->gcPauseMicros set, major collections are incremental
+// instead: a step of marking or sweeping runs after every
+// GC_STEP_SIZE bytes of allocation and stops once it took that long.
+// They mark what was reachable when they started (snapshot at the
+// beginning): the cycle starts with a minor collection, so nothing
+// is young, which also marks the roots gray. The steps then blacken
+// gray objects, tri-color style. The mutator may meanwhile move a white
+// object out of the way of the marking, snapshotBarrier() marks every
+// reference overwritten outside the stack for that. Objects promoted
+// while marking are promoted marked, and the marking leaves young
+// objects to the minor collections. Once no object is gray, the next
+// minor collection ends the marking, and the old lists are set aside
+// to be swept step by step, the survivors going back to vm->objects. A cycle that falls behind, the heap growing another
+// GC_HEAP_GROW_FACTOR times, is finished in one pause.
+
+// the heap may grow this many times its live size
+// before the next major collection
+#define GC_HEAP_GROW_FACTOR 2
+// bytes allocated between minor collections
+#define NURSERY_SIZE (256 * 1024)
+// smaller heaps are not worth waking up threads for
+#define PARALLEL_GC_MIN_HEAP (4 * 1024 * 1024)
+// bytes allocated between two steps of an incremental collection
+#define GC_STEP_SIZE (64 * 1024)
+// objects a step marks or sweeps between two looks at the clock
+#define GC_STEP_CHECK 64
+
+#ifdef PARALLEL_GC
+typedef struct GCThread GCThread;
+typedef struct
+{
+  Workers *workers;
+  GCThread *threads;
+  Obj **regions;
+  // the next old list to sweep
+  int nextRegion;
+} ParallelGC;
+struct GCThread
+{
+  ParallelGC *gc;
+  int index;
+  PoolReturns returns;
+  size_t freedBytes;
+  Obj *deferred;
+};
+// set while this thread marks or sweeps for a parallel collection
+static THREAD_LOCAL GCThread *gcThread = NULL;
+// other threads may set the mark bit of the object meanwhile
+#define LOAD_HEADER(object) __atomic_load_n(&(object)->header, __ATOMIC_RELAXED)
+#else
+#define LOAD_HEADER(object) ((object)->header)
+#endif
+
+static void collectNursery();
+static void startCycle();
+static void collectStep();
+static void finishCycle();
+
+static uint64_t nanoTime()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+// runs collect and counts the time it took as a pause of that kind
+static void pause(PauseKind kind, void (*collect)())
+{
+  uint64_t start = nanoTime();
+  collect();
+  uint64_t length = nanoTime() - start;
+  PauseStats *stats = &vm->pauses[kind];
+  stats->count++;
+  stats->totalNanos += length;
+  if (length > stats->maxNanos)
+    stats->maxNanos = length;
+}
+static void startMajor()
+{
+  if (vm->gcPauseMicros > 0)
+    pause(PAUSE_MINOR, startCycle);
+  else
+    pause(PAUSE_FULL, collectGarbage);
+}
+static void finishMarking();
+// a minor collection, which also ends the marking
+// of an incremental collection once nothing is gray
+static void collectMinor()
+{
+  if (vm->gcPhase == GC_MARK && vm->grayCount == 0)
+    finishMarking();
+  else
+    collectNursery();
+}
+// every allocation is counted here, growing past nextGC starts
+// a major collection, filling the nursery a minor one
+static void countBytes(size_t oldSize, size_t newSize)
+{
+  vm->bytesAllocated += newSize - oldSize;
+  if (newSize > oldSize)
+  {
+    vm->youngBytes += newSize - oldSize;
+#ifdef DEBUG_STRESS_GC
+    // mostly minor collections, which promote objects right
+    // after they are made and so exercise the write barriers
+    if (vm->minorCollections == 7 && vm->gcPhase == GC_IDLE)
+      startMajor();
+    else
+      collectMinor();
+    if (vm->gcPhase != GC_IDLE)
+      collectStep();
+#endif
+    if (vm->gcPhase != GC_IDLE)
+    {
+      vm->stepBytes += newSize - oldSize;
+      if (vm->bytesAllocated > vm->nextGC * GC_HEAP_GROW_FACTOR)
+        pause(PAUSE_FULL, finishCycle);
+      else if (vm->stepBytes > GC_STEP_SIZE)
+        pause(PAUSE_STEP, collectStep);
+    }
+    else if (vm->bytesAllocated > vm->nextGC)
+    {
+      startMajor();
+    }
+    if (vm->youngBytes > NURSERY_SIZE)
+    {
+      pause(PAUSE_MINOR, collectMinor);
+    }
+  }
+}
 void *reallocate(void *pointer, size_t oldSize, size_t newSize)
 {
+  countBytes(oldSize, newSize);
   if (newSize == 0)
   {
     // free allocation
@@ -17,15 +181,162 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize)
     exit(1);
   return result;
 }
+// fixed-size blocks such as objects, freed with the
+// same size through freePooled()
+void *allocatePooled(size_t size)
+{
+#ifdef POOL_ALLOCATOR
+  countBytes(0, size);
+  return poolAllocate(&vm->pools, size);
+#else
+  return reallocate(NULL, 0, size);
+#endif
+}
+void freePooled(void *pointer, size_t size)
+{
+#ifdef PARALLEL_GC
+  if (gcThread != NULL)
+  {
+    gcThread->freedBytes += size;
+#ifdef POOL_ALLOCATOR
+    poolDefer(&gcThread->returns, pointer, size);
+#else
+    free(pointer);
+#endif
+    return;
+  }
+#endif
+#ifdef POOL_ALLOCATOR
+  countBytes(size, 0);
+  poolFree(&vm->pools, pointer, size);
+#else
+  reallocate(pointer, size, 0);
+#endif
+}
+// the remembered set is not allocated through reallocate(),
+// barriers run where a collection must not start
+void rememberObject(Obj *object)
+{
+  if (hasFlag(object, OBJ_REMEMBERED))
+    return;
+  setFlag(object, OBJ_REMEMBERED);
+  if (vm->rememberedCapacity < vm->rememberedCount + 1)
+  {
+    vm->rememberedCapacity = GROW_CAPACITY(vm->rememberedCapacity);
+    vm->remembered = (Obj **)realloc(vm->remembered, sizeof(Obj *) * vm->rememberedCapacity);
+    if (vm->remembered == NULL)
+      exit(1);
+  }
+  vm->remembered[vm->rememberedCount++] = object;
+}
+void markObject(Obj *object)
+{
+  if (object == NULL)
+    return;
+#ifdef PARALLEL_GC
+  if (gcThread != NULL)
+  {
+    // only the thread that sets the mark traces the object
+    if (!(__atomic_load_n(&object->header, __ATOMIC_RELAXED) & OBJ_MARKED) &&
+        !(__atomic_fetch_or(&object->header, OBJ_MARKED, __ATOMIC_RELAXED) & OBJ_MARKED))
+      workPush(gcThread->gc->workers, gcThread->index, object);
+    return;
+  }
+#endif
+  if (hasFlag(object, OBJ_MARKED))
+    return;
+  // a minor collection only marks young objects,
+  // an incremental major one only old ones
+  if (hasFlag(object, OBJ_OLD) ? vm->minorCollection
+                               : vm->gcPhase == GC_MARK && !vm->minorCollection)
+    return;
+#ifdef DEBUG_LOG_GC
+  printf("%p mark ", (void *)object);
+  printValue(OBJ_VAL(object));
+  printf("\n");
+#endif
+  setFlag(object, OBJ_MARKED);
+  // the gray stack is not allocated through reallocate()
+  // so that growing it cannot start a nested collection
+  if (vm->grayCapacity < vm->grayCount + 1)
+  {
+    vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+    vm->grayStack = (Obj **)realloc(vm->grayStack, sizeof(Obj *) * vm->grayCapacity);
+    if (vm->grayStack == NULL)
+      exit(1);
+  }
+  vm->grayStack[vm->grayCount++] = object;
+}
+void markValue(Value value)
+{
+  // numbers, booleans and nil are not on the heap
+  if (IS_OBJ(value))
+    markObject(AS_OBJ(value));
+}
+static void markArray(ValueArray *array)
+{
+  for (int i = 0; i < array->count; i++)
+  {
+    markValue(array->values[i]);
+  }
+}
+// marks everything a gray object refers to,
+// which turns the object black
+static void blackenObject(Obj *object)
+{
+#ifdef DEBUG_LOG_GC
+  printf("%p blacken ", (void *)object);
+  printValue(OBJ_VAL(object));
+  printf("\n");
+#endif
+  switch (HEADER_TYPE(LOAD_HEADER(object)))
+  {
+  case OBJ_CLOSURE:
+  {
+    ObjClosure *closure = (ObjClosure *)object;
+    markObject((Obj *)closure->function);
+    for (int i = 0; i < closure->upvalueCount; i++)
+    {
+      markValue(closure->upvalues[i]);
+    }
+    break;
+  }
+  case OBJ_FUNCTION:
+  {
+    ObjFunction *function = (ObjFunction *)object;
+    markObject((Obj *)function->name);
+    markArray(&function->chunk.constants);
+    break;
+  }
+  case OBJ_UPVALUE:
+    // an open upvalue points into the stack, which is a root
+    markValue(((ObjUpvalue *)object)->closed);
+    break;
+  case OBJ_ROPE:
+  {
+    ObjRope *rope = (ObjRope *)object;
+    markObject(rope->left);
+    markObject(rope->right);
+    markObject((Obj *)rope->flat);
+    break;
+  }
+  case OBJ_NATIVE:
+  case OBJ_STRING:
+    break;
+  }
+}
 static void freeObject(Obj *object)
 {
-  switch (object->type)
+#ifdef DEBUG_LOG_GC
+  printf("%p free type %d\n", (void *)object, objType(object));
+#endif
+  switch (objType(object))
   {
   case OBJ_CLOSURE:
   {
     // free the array, but not the Upvalues
     ObjClosure *closure = (ObjClosure *)object;
-    FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalueCount);
+    freePooled(closure->upvalues, sizeof(Value) * closure->upvalueCount);
     // do not free the function because other
     // closures may use the same function
     FREE(ObjClosure, object);
@@ -34,6 +345,10 @@ static void freeObject(Obj *object)
   case OBJ_FUNCTION:
   {
     ObjFunction *func = (ObjFunction *)object;
+#ifdef JIT
+    if (func->jitCode != NULL)
+      jitFree(func->jitCode);
+#endif
     freeChunk(&func->chunk);
     FREE(ObjFunction, object);
     break;
@@ -41,11 +356,14 @@ static void freeObject(Obj *object)
   case OBJ_NATIVE:
     FREE(ObjNative, object);
     break;
+  case OBJ_ROPE:
+    // the halves are objects of their own
+    FREE(ObjRope, object);
+    break;
   case OBJ_STRING:
   {
     ObjString *string = (ObjString *)object;
-    FREE_ARRAY(char, string->chars, string->length + 1);
-    FREE(ObjString, object);
+    freePooled(object, sizeof(ObjString) + string->length + 1);
     break;
   }
   case OBJ_UPVALUE:
@@ -54,13 +372,422 @@ static void freeObject(Obj *object)
     break;
   }
 }
-void freeObjects()
+// the roots both kinds of collection mark
+static void markRoots()
+{
+  for (Value *slot = vm->stack; slot < vm->stackTop; slot++)
+  {
+    markValue(*slot);
+    markObject((Obj *)vm->openSlots[slot - vm->stack]);
+  }
+  for (int i = 0; i < vm->frameCount; i++)
+  {
+    markObject((Obj *)vm->frames[i].function);
+  }
+  // functions still being compiled are not reachable
+  // from the VM yet
+  markCompilerRoots();
+}
+static void markGlobals()
+{
+  for (int i = 0; i < vm->globalValues.count; i++)
+  {
+    markValue(vm->globalValues.values[i]);
+  }
+  markTable(&vm->globalNames);
+}
+// the old objects and globals that may refer to young objects,
+// the rest of the old generation is not looked at
+static void markRemembered()
+{
+  for (int i = 0; i < vm->rememberedCount; i++)
+  {
+    blackenObject(vm->remembered[i]);
+  }
+  for (int card = 0; card * GLOBAL_CARD_SIZE < vm->globalValues.count; card++)
+  {
+    if (!vm->globalCards[card])
+      continue;
+    int end = (card + 1) * GLOBAL_CARD_SIZE;
+    if (end > vm->globalValues.count)
+      end = vm->globalValues.count;
+    for (int i = card * GLOBAL_CARD_SIZE; i < end; i++)
+      markValue(vm->globalValues.values[i]);
+  }
+  if (vm->globalNamesDirty)
+    markTable(&vm->globalNames);
+}
+// after a collection nothing is young, so nothing is remembered
+static void forgetRemembered()
+{
+  for (int i = 0; i < vm->rememberedCount; i++)
+  {
+    clearFlag(vm->remembered[i], OBJ_REMEMBERED);
+  }
+  vm->rememberedCount = 0;
+  memset(vm->globalCards, 0, sizeof(vm->globalCards));
+  vm->globalNamesDirty = false;
+}
+// blackens the gray objects above bottom
+static void traceReferences(int bottom)
+{
+  while (vm->grayCount > bottom)
+  {
+    Obj *object = vm->grayStack[--vm->grayCount];
+    blackenObject(object);
+  }
+}
+// frees every unmarked object of an old list and clears
+// the mark on the survivors for the next cycle
+static void sweepList(Obj **list)
+{
+  Obj *previous = NULL;
+  Obj *object = *list;
+  while (object != NULL)
+  {
+    if (hasFlag(object, OBJ_MARKED))
+    {
+      clearFlag(object, OBJ_MARKED);
+      previous = object;
+      object = objNext(object);
+    }
+    else
+    {
+      Obj *unreached = object;
+      object = objNext(object);
+      if (previous != NULL)
+      {
+        setObjNext(previous, object);
+      }
+      else
+      {
+        *list = object;
+      }
+#ifdef PARALLEL_GC
+      if (gcThread != NULL && objType(unreached) == OBJ_FUNCTION)
+      {
+        setObjNext(unreached, gcThread->deferred);
+        gcThread->deferred = unreached;
+        continue;
+      }
+#endif
+      freeObject(unreached);
+    }
+  }
+}
+static void sweep()
+{
+  for (int i = 0; i < GC_REGIONS; i++)
+  {
+    sweepList(&vm->objects[i]);
+  }
+}
+// frees the unmarked young objects and promotes the others,
+// which costs time in proportion to the nursery only. While an
+// incremental collection marks, they are promoted marked
+static void sweepNursery()
+{
+  Obj **region = &vm->objects[vm->promoteRegion];
+  vm->promoteRegion = (vm->promoteRegion + 1) % GC_REGIONS;
+  Obj *object = vm->youngObjects;
+  while (object != NULL)
+  {
+    Obj *next = objNext(object);
+    if (hasFlag(object, OBJ_MARKED))
+    {
+      if (vm->gcPhase != GC_MARK)
+        clearFlag(object, OBJ_MARKED);
+      setFlag(object, OBJ_OLD);
+      setObjNext(object, *region);
+      *region = object;
+    }
+    else
+    {
+      // a minor collection does not look at the whole
+      // intern table, dead strings leave it one by one
+      if (vm->minorCollection && objType(object) == OBJ_STRING)
+        tableDelete(&vm->strings, (ObjString *)object);
+      freeObject(object);
+    }
+    object = next;
+  }
+  vm->youngObjects = NULL;
+  vm->youngBytes = 0;
+}
+static void collectNursery()
+{
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc begin\n");
+  size_t before = vm->bytesAllocated;
+#endif
+  // the gray objects of an incremental collection stay below
+  int grayBottom = vm->grayCount;
+  vm->minorCollection = true;
+  markRoots();
+  markRemembered();
+  traceReferences(grayBottom);
+  sweepNursery();
+  vm->minorCollection = false;
+  forgetRemembered();
+  vm->minorCollections++;
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc end\n");
+  printf("   collected %zu bytes (from %zu to %zu)\n",
+         before - vm->bytesAllocated, before, vm->bytesAllocated);
+#endif
+}
+static void freeList(Obj *object)
 {
-  Obj *object = vm.objects;
   while (object != NULL)
   {
-    Obj *next = object->next;
+    Obj *next = objNext(object);
     freeObject(object);
     object = next;
   }
+}
+#ifdef PARALLEL_GC
+static void markTask(void *context, int worker)
+{
+  ParallelGC *gc = (ParallelGC *)context;
+  gcThread = &gc->threads[worker];
+  Obj *object;
+  while ((object = (Obj *)workTake(gc->workers, worker)) != NULL)
+  {
+    blackenObject(object);
+  }
+  gcThread = NULL;
+}
+static void sweepTask(void *context, int worker)
+{
+  ParallelGC *gc = (ParallelGC *)context;
+  gcThread = &gc->threads[worker];
+  int region;
+  while ((region = __atomic_fetch_add(&gc->nextRegion, 1, __ATOMIC_RELAXED)) < GC_REGIONS)
+  {
+    sweepList(&gc->regions[region]);
+  }
+  gcThread = NULL;
+}
+static ParallelGC *startParallel()
+{
+  if (vm->gcThreads < 2 || vm->bytesAllocated < PARALLEL_GC_MIN_HEAP)
+    return NULL;
+  if (vm->gcWorkers != NULL && workerCount(vm->gcWorkers) != vm->gcThreads)
+  {
+    freeWorkers(vm->gcWorkers);
+    vm->gcWorkers = NULL;
+  }
+  if (vm->gcWorkers == NULL)
+    vm->gcWorkers = newWorkers(vm->gcThreads);
+  ParallelGC *gc = (ParallelGC *)malloc(sizeof(ParallelGC));
+  GCThread *threads = (GCThread *)calloc(vm->gcThreads, sizeof(GCThread));
+  if (gc == NULL || threads == NULL)
+    exit(1);
+  gc->workers = vm->gcWorkers;
+  gc->threads = threads;
+  gc->regions = vm->objects;
+  gc->nextRegion = 0;
+  for (int i = 0; i < vm->gcThreads; i++)
+  {
+    threads[i].gc = gc;
+    threads[i].index = i;
+  }
+  return gc;
+}
+static void traceParallel(ParallelGC *gc)
+{
+  // the roots were marked onto the gray stack
+  for (int i = 0; i < vm->grayCount; i++)
+  {
+    workPush(gc->workers, i % vm->gcThreads, vm->grayStack[i]);
+  }
+  vm->grayCount = 0;
+  runWorkers(gc->workers, markTask, gc);
+}
+static void sweepParallel(ParallelGC *gc)
+{
+  runWorkers(gc->workers, sweepTask, gc);
+  for (int i = 0; i < vm->gcThreads; i++)
+  {
+    GCThread *thread = &gc->threads[i];
+#ifdef POOL_ALLOCATOR
+    poolReturn(&vm->pools, &thread->returns);
+#endif
+    vm->bytesAllocated -= thread->freedBytes;
+    freeList(thread->deferred);
+  }
+  free(gc->threads);
+  free(gc);
+}
+#endif
+// the minor collection that starts an incremental major one
+static void startCycle()
+{
+#ifdef DEBUG_LOG_GC
+  printf("-- incremental gc begin\n");
+#endif
+  collectNursery();
+  vm->gcPhase = GC_MARK;
+  vm->stepBytes = 0;
+  vm->minorCollections = 0;
+  markRoots();
+  markGlobals();
+}
+// blackens gray objects until there are none
+// or until the deadline passed
+static void markUntil(uint64_t deadline)
+{
+  int work = 0;
+  while (vm->grayCount > 0)
+  {
+    Obj *object = vm->grayStack[--vm->grayCount];
+    blackenObject(object);
+    if (++work % GC_STEP_CHECK == 0 && nanoTime() >= deadline)
+      return;
+  }
+}
+static void finishMarking()
+{
+  // nothing is young or remembered afterwards, so no
+  // old object in the lists swept may be referred to
+  collectNursery();
+  tableRemoveWhite(&vm->strings);
+  for (int i = 0; i < GC_REGIONS; i++)
+  {
+    vm->unswept[i] = vm->objects[i];
+    vm->objects[i] = NULL;
+  }
+  vm->sweepRegion = 0;
+  vm->gcPhase = GC_SWEEP;
+}
+// sweeps the lists set aside until they are done, true,
+// or until the deadline passed, false
+static bool sweepUntil(uint64_t deadline)
+{
+  int work = 0;
+  while (vm->sweepRegion < GC_REGIONS)
+  {
+    Obj *object = vm->unswept[vm->sweepRegion];
+    if (object == NULL)
+    {
+      vm->sweepRegion++;
+      continue;
+    }
+    vm->unswept[vm->sweepRegion] = objNext(object);
+    if (hasFlag(object, OBJ_MARKED))
+    {
+      clearFlag(object, OBJ_MARKED);
+      setObjNext(object, vm->objects[vm->sweepRegion]);
+      vm->objects[vm->sweepRegion] = object;
+    }
+    else
+    {
+      freeObject(object);
+    }
+    if (++work % GC_STEP_CHECK == 0 && nanoTime() >= deadline)
+      return false;
+  }
+  return true;
+}
+static void finishSweeping()
+{
+  vm->gcPhase = GC_IDLE;
+  vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+#ifdef DEBUG_LOG_GC
+  printf("-- incremental gc end\n");
+  printf("   %zu bytes allocated, next at %zu\n", vm->bytesAllocated, vm->nextGC);
+#endif
+}
+// marks or sweeps for up to vm->gcPauseMicros
+static void collectStep()
+{
+  uint64_t deadline = vm->gcPauseMicros > 0
+                          ? nanoTime() + (uint64_t)vm->gcPauseMicros * 1000
+                          : UINT64_MAX;
+  vm->stepBytes = 0;
+  if (vm->gcPhase == GC_MARK)
+    markUntil(deadline);
+  else if (sweepUntil(deadline))
+    finishSweeping();
+}
+// the rest of an incremental collection in one pause
+static void finishCycle()
+{
+  if (vm->gcPhase == GC_MARK)
+  {
+    traceReferences(0);
+    finishMarking();
+  }
+  if (vm->gcPhase == GC_SWEEP)
+  {
+    sweepUntil(UINT64_MAX);
+    finishSweeping();
+  }
+}
+// the major collection in one pause
+void collectGarbage()
+{
+  finishCycle();
+#ifdef DEBUG_LOG_GC
+  printf("-- gc begin\n");
+  size_t before = vm->bytesAllocated;
+#endif
+  markRoots();
+  markGlobals();
+#ifdef PARALLEL_GC
+  ParallelGC *gc = startParallel();
+  if (gc != NULL)
+    traceParallel(gc);
+  else
+#endif
+    traceReferences(0);
+  // vm->strings only interns strings, it must not keep them alive
+  tableRemoveWhite(&vm->strings);
+  forgetRemembered();
+  // the old objects first, the promoted ones are unmarked
+#ifdef PARALLEL_GC
+  if (gc != NULL)
+    sweepParallel(gc);
+  else
+#endif
+    sweep();
+  sweepNursery();
+  vm->minorCollections = 0;
+  vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+#ifdef DEBUG_LOG_GC
+  printf("-- gc end\n");
+  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+         before - vm->bytesAllocated, before, vm->bytesAllocated, vm->nextGC);
+#endif
+}
+void freeObjects()
+{
+#ifdef PARALLEL_GC
+  freeWorkers(vm->gcWorkers);
+#endif
+  for (int i = 0; i < GC_REGIONS; i++)
+  {
+    freeList(vm->objects[i]);
+    freeList(vm->unswept[i]);
+  }
+  freeList(vm->youngObjects);
+  free(vm->grayStack);
+  free(vm->remembered);
+#ifdef POOL_ALLOCATOR
+  freePools(&vm->pools);
+#endif
+}
+void printGCStats(FILE *out)
+{
+  static const char *kinds[PAUSE_KINDS] = {"minor", "step", "full"};
+  fprintf(out, "%6s %8s %10s %10s %10s\n", "pause", "count", "total ms", "mean us", "max us");
+  for (int i = 0; i < PAUSE_KINDS; i++)
+  {
+    PauseStats *stats = &vm->pauses[i];
+    if (stats->count == 0)
+      continue;
+    fprintf(out, "%6s %8d %10.1f %10.1f %10.1f\n", kinds[i], stats->count,
+            stats->totalNanos / 1e6, stats->totalNanos / 1e3 / stats->count,
+            stats->maxNanos / 1e3);
+  }
 }
\ No newline at end of file
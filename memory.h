@@ -1,6 +1,8 @@
 #ifndef clox_memory_h
 #define clox_memory_h
 
+#include <stdio.h>
+
 #include "common.h"
 #include "object.h"
 
@@ -16,9 +18,31 @@
 #define FREE_ARRAY(type, pointer, oldCount) \
   reallocate(pointer, sizeof(type) * (oldCount), 0)
 
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+// objects are never resized, they come from the pools
+#define FREE(type, pointer) freePooled(pointer, sizeof(type))
 
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
+void *allocatePooled(size_t size);
+void freePooled(void *pointer, size_t size);
+void rememberObject(Obj *object);
+// must follow every store of a reference into an object that may
+// be old. Minor collections only trace the old objects remembered
+// here, so a young object they are the only path to is kept alive
+static inline void writeBarrier(Obj *owner, Obj *target)
+{
+  if (hasFlag(owner, OBJ_OLD) && target != NULL && !hasFlag(target, OBJ_OLD))
+    rememberObject(owner);
+}
+static inline void writeValueBarrier(Obj *owner, Value value)
+{
+  if (IS_OBJ(value))
+    writeBarrier(owner, AS_OBJ(value));
+}
+void markObject(Obj *object);
+void markValue(Value value);
+void collectGarbage();
 void freeObjects();
+// the count, total and longest pause of each kind
+void printGCStats(FILE *out);
 
 #endif
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -12,20 +13,24 @@
 
 static Obj *allocateObject(size_t size, ObjType type)
 {
-  Obj *object = (Obj *)reallocate(NULL, 0, size);
-  object->type = type;
-  // add to linked list
-  object->next = vm.objects;
-  vm.objects = object;
+  Obj *object = (Obj *)allocatePooled(size);
+  if (((uint64_t)(uintptr_t)object & ~OBJ_NEXT_MASK) != 0)
+  {
+    fprintf(stderr, "Object address does not fit in 48 bits.\n");
+    exit(1);
+  }
+  // add to the nursery
+  object->header = (uint64_t)type << OBJ_TYPE_SHIFT | (uintptr_t)vm->youngObjects;
+  vm->youngObjects = object;
   return object;
 }
 
 ObjClosure *newClosure(ObjFunction *function)
 {
-  ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, function->upvalueCount);
+  Value *upvalues = (Value *)allocatePooled(sizeof(Value) * function->upvalueCount);
   for (int i = 0; i < function->upvalueCount; i++)
   {
-    upvalues[i] = NULL;
+    upvalues[i] = NIL_VAL;
   }
   ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
   closure->function = function;
@@ -38,7 +43,10 @@ ObjFunction *newFunction()
   ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
   function->arity = 0;
   function->upvalueCount = 0;
+  function->stackSlots = 0;
   function->name = NULL;
+  function->jitCode = NULL;
+  function->hotness = 0;
   initChunk(&function->chunk);
   return function;
 }
@@ -49,55 +57,214 @@ ObjNative *newNative(NativeFn function, int arity)
   native->arity = arity;
   return native;
 }
-static ObjString *allocateString(char *chars, int length, uint32_t hash)
+// a string of length characters for the caller to fill in
+// and pass to internString() before allocating anything else
+ObjString *allocateString(int length)
 {
-  ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+  ObjString *string = (ObjString *)allocateObject(sizeof(ObjString) + length + 1, OBJ_STRING);
   string->length = length;
-  string->chars = chars;
-  string->hash = hash;
-  tableSet(&vm.strings, string, NIL_VAL);
+  string->chars[length] = '\0';
   return string;
 }
-uint32_t hashString(const char *key, int length)
+static void addToInterned(ObjString *string)
+{
+  // growing the intern table can collect, so keep
+  // the new string reachable until it is stored
+  push(OBJ_VAL(string));
+  tableSet(&vm->strings, string, NIL_VAL);
+  pop();
+}
+// String hashing reads eight bytes at a time and folds them in with a
+// 64x64->128 bit multiply, xoring the two halves of the product, in
+// the style of wyhash. Short strings take one multiply for the tail
+// plus one to finish, so identifiers cost about as much as a single
+// byte did with FNV-1a, and long strings go through 16 bytes per
+// multiply. The low bits, which pick the table slot, depend on every
+// input bit.
+#define HASH_SEED 0x2d358dccaa6c78a5ull
+#define HASH_PRIME1 0x8bb84b93962eacc9ull
+#define HASH_PRIME2 0x4b33a62ed433d4a3ull
+
+static inline uint64_t hashMix(uint64_t a, uint64_t b)
 {
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; i++)
+#ifdef __SIZEOF_INT128__
+  unsigned __int128 product = (unsigned __int128)a * b;
+  return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+  uint64_t aLow = (uint32_t)a, aHigh = a >> 32;
+  uint64_t bLow = (uint32_t)b, bHigh = b >> 32;
+  uint64_t low = aLow * bLow, middle1 = aHigh * bLow, middle2 = aLow * bHigh;
+  uint64_t high = aHigh * bHigh;
+  uint64_t carry = ((low >> 32) + (uint32_t)middle1 + (uint32_t)middle2) >> 32;
+  high += (middle1 >> 32) + (middle2 >> 32) + carry;
+  low += (middle1 << 32) + (middle2 << 32);
+  return low ^ high;
+#endif
+}
+// unaligned loads, in the byte order of the machine
+static inline uint64_t read64(const char *p)
+{
+  uint64_t word;
+  memcpy(&word, p, sizeof(word));
+  return word;
+}
+static inline uint64_t read32(const char *p)
+{
+  uint32_t word;
+  memcpy(&word, p, sizeof(word));
+  return word;
+}
+uint64_t hashBytes(const char *key, int length)
+{
+  uint64_t hash = HASH_SEED ^ (uint64_t)length;
+  uint64_t a = 0, b = 0;
+  if (length <= 16)
+  {
+    // the tail is read as two words that overlap when it is
+    // shorter than both together
+    if (length >= 8)
+    {
+      a = read64(key);
+      b = read64(key + length - 8);
+    }
+    else if (length >= 4)
+    {
+      a = read32(key);
+      b = read32(key + length - 4);
+    }
+    else if (length > 0)
+    {
+      a = ((uint64_t)(uint8_t)key[0] << 16) | ((uint64_t)(uint8_t)key[length >> 1] << 8) |
+          (uint8_t)key[length - 1];
+    }
+  }
+  else
   {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
+    const char *p = key;
+    int left = length;
+    for (; left > 16; p += 16, left -= 16)
+      hash = hashMix(read64(p) ^ HASH_PRIME1, read64(p + 8) ^ hash);
+    a = read64(key + length - 16);
+    b = read64(key + length - 8);
   }
-  return hash;
+  hash = hashMix(a ^ HASH_PRIME1, b ^ hash);
+  return hashMix(hash ^ HASH_PRIME2, (uint64_t)length ^ HASH_PRIME1);
 }
-ObjString *takeString(char *chars, int length)
+uint32_t hashString(const char *key, int length)
 {
-  uint32_t hash = hashString(chars, length);
-  ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+  uint64_t hash = hashBytes(key, length);
+  return (uint32_t)(hash ^ (hash >> 32));
+}
+// returns the equal string if one is interned already, in
+// which case the new string is freed
+ObjString *internString(ObjString *string)
+{
+  string->hash = hashString(string->chars, string->length);
+  ObjString *interned = tableFindString(&vm->strings, string->chars, string->length, string->hash);
   if (interned != NULL)
   {
-    FREE_ARRAY(char, chars, length + 1);
+    // the table does not keep its strings alive, a collection
+    // may not have reached the string it hands back yet
+    snapshotBarrier(OBJ_VAL(interned));
+    // nothing was allocated since, so it is still the newest object
+    vm->youngObjects = objNext(&string->obj);
+    freePooled(string, sizeof(ObjString) + string->length + 1);
     return interned;
   }
-  return allocateString(chars, length, hash);
+  addToInterned(string);
+  return string;
 }
 ObjString *copyString(const char *chars, int length)
 {
   uint32_t hash = hashString(chars, length);
-  ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+  ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
   if (interned != NULL)
+  {
+    snapshotBarrier(OBJ_VAL(interned));
     return interned;
-  char *heapChars = ALLOCATE(char, length + 1);
-  memcpy(heapChars, chars, length);
-  heapChars[length] = '\0';
-  return allocateString(heapChars, length, hash);
+  }
+  ObjString *string = allocateString(length);
+  memcpy(string->chars, chars, length);
+  string->hash = hash;
+  addToInterned(string);
+  return string;
 }
 ObjUpvalue *newUpvalue(Value *slot)
 {
   ObjUpvalue *upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
   upvalue->location = slot;
   upvalue->closed = NIL_VAL;
-  upvalue->next = NULL;
   return upvalue;
 }
+ObjRope *newRope(Obj *left, Obj *right, int length)
+{
+  ObjRope *rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+  rope->length = length;
+  rope->left = left;
+  rope->right = right;
+  rope->flat = NULL;
+  return rope;
+}
+// writes the characters of a string or rope to dest. It loops on
+// the longer half and recurses on the shorter one, so the recursion
+// is at most log2(length) deep however lopsided the rope is.
+static void copyText(Obj *object, char *dest)
+{
+  while (objType(object) == OBJ_ROPE && ((ObjRope *)object)->flat == NULL)
+  {
+    ObjRope *rope = (ObjRope *)object;
+    int leftLength = textLength(rope->left);
+    if (leftLength < rope->length - leftLength)
+    {
+      copyText(rope->left, dest);
+      dest += leftLength;
+      object = rope->right;
+    }
+    else
+    {
+      copyText(rope->right, dest + leftLength);
+      object = rope->left;
+    }
+  }
+  ObjString *string = objType(object) == OBJ_ROPE ? ((ObjRope *)object)->flat : (ObjString *)object;
+  memcpy(dest, string->chars, string->length);
+}
+// the interned string with the characters of the rope
+ObjString *flattenRope(ObjRope *rope)
+{
+  if (rope->flat != NULL)
+    return rope->flat;
+  // allocating may collect, the halves are reachable through the rope
+  push(OBJ_VAL(rope));
+  ObjString *string = allocateString(rope->length);
+  copyText((Obj *)rope, string->chars);
+  rope->flat = internString(string);
+  // the rope may have been promoted while the string was made
+  writeBarrier((Obj *)rope, (Obj *)rope->flat);
+  // the halves are no longer needed
+  snapshotBarrier(OBJ_VAL(rope->left));
+  snapshotBarrier(OBJ_VAL(rope->right));
+  rope->left = NULL;
+  rope->right = NULL;
+  pop();
+  return rope->flat;
+}
+// prints without flattening, so printing neither
+// allocates on the heap nor interns the string
+static void printRope(ObjRope *rope)
+{
+  if (rope->flat != NULL)
+  {
+    printf("%s", rope->flat->chars);
+    return;
+  }
+  char *chars = (char *)malloc(rope->length);
+  if (chars == NULL)
+    exit(1);
+  copyText((Obj *)rope, chars);
+  fwrite(chars, 1, rope->length, stdout);
+  free(chars);
+}
 static void printFunction(ObjFunction *function)
 {
   if (function->name == NULL)
@@ -124,6 +291,9 @@ void printObject(Value value)
   case OBJ_NATIVE:
     printf("<native fn>");
     break;
+  case OBJ_ROPE:
+    printRope(AS_ROPE(value));
+    break;
   case OBJ_STRING:
     printf("%s", AS_CSTRING(value));
     break;
@@ -7,7 +7,7 @@
 
 // get the type from a value.
 // the value must be an object
-#define OBJ_TYPE(value) (AS_OBJ(value)->type)
+#define OBJ_TYPE(value) (objType(AS_OBJ(value)))
 
 #define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
@@ -15,6 +15,8 @@
 // check if obj is string so we can cast
 // obj* to obj_string*
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
+#define IS_STRING_OR_ROPE(value) (IS_STRING(value) || IS_ROPE(value))
 
 #define AS_CLOSURE(value) ((ObjClosure *)AS_OBJ(value))
 #define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
@@ -22,31 +24,63 @@
 #define AS_NATIVE(value) (((ObjNative *)AS_OBJ(value))->function)
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
+#define AS_ROPE(value) ((ObjRope *)AS_OBJ(value))
+#define AS_UPVALUE(value) ((ObjUpvalue *)AS_OBJ(value))
+
+// concatenations shorter than this are copied into a
+// flat string right away instead of becoming a rope
+#define ROPE_MIN_LENGTH 64
+// the longest string or rope, lengths are ints
+#define STRING_LENGTH_MAX INT32_MAX
 
 typedef enum
 {
   OBJ_CLOSURE,
   OBJ_FUNCTION,
   OBJ_NATIVE,
+  OBJ_ROPE,
   OBJ_STRING,
   OBJ_UPVALUE,
 } ObjType;
 
+// the header of every object is one word. Its low 48 bits are
+// the next object in the object's list, user space addresses on
+// x86-64 and AArch64 fit in them. The type and the flags are
+// packed into the 16 bits above.
+#define OBJ_NEXT_MASK ((UINT64_C(1) << 48) - 1)
+#define OBJ_TYPE_SHIFT 48
+#define HEADER_TYPE(header) ((ObjType)(((header) >> OBJ_TYPE_SHIFT) & 0xff))
+// reached by the running collection
+#define OBJ_MARKED (UINT64_C(1) << 56)
+// survived a collection, only major collections free it
+#define OBJ_OLD (UINT64_C(1) << 57)
+// in the remembered set of the next minor collection
+#define OBJ_REMEMBERED (UINT64_C(1) << 58)
+// bits 59 to 63 are free for more flags
+
 struct Obj
 {
-  ObjType type;
-  struct Obj *next;
+  uint64_t header;
 };
 typedef struct
 {
   Obj obj;
   int arity;
   int upvalueCount;
+  // stack slots reserved above the arguments on every call
+  int stackSlots;
   Chunk chunk;
   ObjString *name;
+  // machine code of the function once it has run hot, see jit.h
+  struct JitCode *jitCode;
+  int hotness;
 } ObjFunction;
 
-typedef Value (*NativeFn)(int argCount, Value *args);
+// gets its arguments at API indexes 0 to argCount - 1 and pushes
+// its result, nil if it pushes nothing. Returns false after
+// reporting a runtime error. The same as LoxNative in clox.h
+struct VM;
+typedef bool (*NativeFn)(struct VM *vm, int argCount);
 typedef struct
 {
   Obj obj;
@@ -54,13 +88,27 @@ typedef struct
   NativeFn function;
 } ObjNative;
 
+// the characters, with a terminating \0, are stored right
+// after the header in the same allocation
 struct ObjString
 {
   Obj obj;
   int length;
-  char *chars;
   uint32_t hash;
+  char chars[];
 };
+// the concatenation of two strings or ropes, built in O(1).
+// It is only copied into one string, hashed and interned when
+// that string is needed, and the result is kept in flat.
+typedef struct
+{
+  Obj obj;
+  int length;
+  // the two halves, NULL once flattened
+  Obj *left;
+  Obj *right;
+  ObjString *flat;
+} ObjRope;
 typedef struct
 {
   Obj obj;
@@ -70,29 +118,66 @@ typedef struct
   // this is where the closed value is
   // stored on the heap
   Value closed;
-  struct ObjUpvalue *next;
 } ObjUpvalue;
 typedef struct
 {
   Obj obj;
   ObjFunction *function;
-  ObjUpvalue **upvalues;
+  // an ObjUpvalue per captured variable, or the variable's
+  // value when it is never assigned after its declaration
+  Value *upvalues;
   int upvalueCount;
 } ObjClosure;
 
 ObjClosure *newClosure(ObjFunction *function);
 ObjFunction *newFunction();
 ObjNative *newNative(NativeFn function, int arity);
-// takes ownership of the string passed in
-ObjString *takeString(char *chars, int length);
+uint64_t hashBytes(const char *key, int length);
+uint32_t hashString(const char *key, int length);
+ObjString *allocateString(int length);
+ObjString *internString(ObjString *string);
 ObjString *copyString(const char *chars, int length);
+// length is at most STRING_LENGTH_MAX, the caller checks it
+ObjRope *newRope(Obj *left, Obj *right, int length);
+ObjString *flattenRope(ObjRope *rope);
 void printObject(Value value);
 
 ObjUpvalue *newUpvalue(Value *slot);
 
+static inline ObjType objType(Obj *object)
+{
+  return HEADER_TYPE(object->header);
+}
+static inline Obj *objNext(Obj *object)
+{
+  return (Obj *)(uintptr_t)(object->header & OBJ_NEXT_MASK);
+}
+static inline void setObjNext(Obj *object, Obj *next)
+{
+  object->header = (object->header & ~OBJ_NEXT_MASK) | (uintptr_t)next;
+}
+static inline bool hasFlag(Obj *object, uint64_t flag)
+{
+  return (object->header & flag) != 0;
+}
+static inline void setFlag(Obj *object, uint64_t flag)
+{
+  object->header |= flag;
+}
+static inline void clearFlag(Obj *object, uint64_t flag)
+{
+  object->header &= ~flag;
+}
 static inline bool isObjType(Value value, ObjType type)
 {
-  return IS_OBJ(value) && AS_OBJ(value)->type == type;
+  return IS_OBJ(value) && objType(AS_OBJ(value)) == type;
+}
+// length of a string or rope
+static inline int textLength(Obj *object)
+{
+  if (objType(object) == OBJ_ROPE)
+    return ((ObjRope *)object)->length;
+  return ((ObjString *)object)->length;
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,275 @@
+#include <stdlib.h>
+
+#include "common.h"
+#include "memory.h"
+#include "optimizer.h"
+
+// Peephole pass over a finished chunk. It fuses common
+// instruction sequences into superinstructions and drops
+// no-ops, then re-targets every jump to the compacted code.
+//
+// A sequence is only fused when none of its instructions
+// after the first is a jump target, so no jump can land
+// inside a superinstruction.
+
+static bool isForwardJump(uint8_t instruction)
+{
+  switch (instruction)
+  {
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_FALSE_POP:
+  case OP_JUMP_IF_NOT_LESS:
+  case OP_JUMP_IF_NOT_GREATER:
+    return true;
+  default:
+    return false;
+  }
+}
+static int jumpTarget(const Chunk *chunk, int offset)
+{
+  int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+  if (chunk->code[offset] == OP_LOOP)
+    return offset + 3 - jump;
+  return offset + 3 + jump;
+}
+
+typedef struct
+{
+  const Chunk *chunk;
+  // number of jumps landing on each offset
+  int *jumpsTo;
+  // instructions that are removed from the output
+  bool *dropped;
+  // start of the instruction before each instruction
+  int *previous;
+} Analysis;
+
+static bool isTarget(Analysis *analysis, int offset)
+{
+  return analysis->jumpsTo[offset] > 0;
+}
+// checks for `n` instructions starting at offset,
+// none of them but the first being jump targets
+static bool fusable(Analysis *analysis, int offset, int n)
+{
+  const Chunk *chunk = analysis->chunk;
+  for (int i = 0; i < n; i++)
+  {
+    if (offset >= chunk->count)
+      return false;
+    if (i > 0 && (isTarget(analysis, offset) || analysis->dropped[offset]))
+      return false;
+    offset += instructionLength(chunk, offset);
+  }
+  return true;
+}
+// a conditional jump followed by OP_POP whose target is
+// another OP_POP pops the condition on both paths.
+// Returns the offset of that target OP_POP or -1.
+static int popOnBothPaths(Analysis *analysis, int jump)
+{
+  const Chunk *chunk = analysis->chunk;
+  if (!fusable(analysis, jump, 2) || chunk->code[jump + 3] != OP_POP)
+    return -1;
+  int target = jumpTarget(chunk, jump);
+  if (target <= jump + 3 || target >= chunk->count || chunk->code[target] != OP_POP)
+    return -1;
+  return target;
+}
+// the OP_POP at a jump target can be removed when this jump
+// is the only way to reach it: nothing else jumps there and
+// the instruction before it never falls through
+static void dropTargetPop(Analysis *analysis, int target)
+{
+  const Chunk *chunk = analysis->chunk;
+  if (analysis->jumpsTo[target] != 1)
+    return;
+  int previous = analysis->previous[target];
+  if (previous == -1)
+    return;
+  uint8_t instruction = chunk->code[previous];
+  if (instruction == OP_JUMP || instruction == OP_LOOP || instruction == OP_RETURN)
+    analysis->dropped[target] = true;
+}
+
+typedef struct
+{
+  uint8_t *code;
+  int count;
+  LineStart *lines;
+  int lineCount;
+} Output;
+
+static void emit(Output *out, uint8_t byte, int line)
+{
+  out->code[out->count] = byte;
+  if (out->lineCount == 0 || out->lines[out->lineCount - 1].line != line)
+  {
+    out->lines[out->lineCount].offset = out->count;
+    out->lines[out->lineCount].line = line;
+    out->lineCount++;
+  }
+  out->count++;
+}
+// jump operands are written as the old target offset
+// and fixed up once the new layout is known
+static void emitJumpTo(Output *out, uint8_t instruction, int target, int line,
+                       int *jumpAt, int *jumpTarget, int *jumpCount)
+{
+  jumpAt[*jumpCount] = out->count;
+  jumpTarget[*jumpCount] = target;
+  (*jumpCount)++;
+  emit(out, instruction, line);
+  emit(out, 0xff, line);
+  emit(out, 0xff, line);
+}
+
+void optimizeChunk(Chunk *chunk)
+{
+  int count = chunk->count;
+  if (count == 0)
+    return;
+  Analysis analysis;
+  analysis.chunk = chunk;
+  analysis.jumpsTo = ALLOCATE(int, count + 1);
+  analysis.dropped = ALLOCATE(bool, count + 1);
+  analysis.previous = ALLOCATE(int, count + 1);
+  for (int i = 0; i <= count; i++)
+  {
+    analysis.jumpsTo[i] = 0;
+    analysis.dropped[i] = false;
+  }
+  int last = -1;
+  for (int offset = 0; offset < count; offset += instructionLength(chunk, offset))
+  {
+    analysis.previous[offset] = last;
+    last = offset;
+    uint8_t instruction = chunk->code[offset];
+    if (isForwardJump(instruction) || instruction == OP_LOOP)
+      analysis.jumpsTo[jumpTarget(chunk, offset)]++;
+  }
+
+  // the output never grows, so it fits in the old capacity.
+  // Its lines are those of a subsequence of the input's bytes,
+  // which cannot change line more often than the input does
+  Output out;
+  out.code = ALLOCATE(uint8_t, chunk->capacity);
+  out.count = 0;
+  int lineCapacity = chunk->lineCount;
+  out.lines = ALLOCATE(LineStart, lineCapacity);
+  out.lineCount = 0;
+  // old offset -> new offset, dropped instructions map
+  // to whatever follows them
+  int *newOffset = ALLOCATE(int, count + 1);
+  int *jumpAt = ALLOCATE(int, count);
+  int *jumpTo = ALLOCATE(int, count);
+  int jumpCount = 0;
+
+  const uint8_t *code = chunk->code;
+  int offset = 0;
+  while (offset < count)
+  {
+    newOffset[offset] = out.count;
+    uint8_t instruction = code[offset];
+    int line = getLine(chunk, offset);
+    int length = instructionLength(chunk, offset);
+
+    if (analysis.dropped[offset] || instruction == OP_NO_OP)
+    {
+      offset += length;
+      continue;
+    }
+    // OP_GET_LOCAL a, OP_GET_LOCAL b, OP_ADD
+    if (instruction == OP_GET_LOCAL && fusable(&analysis, offset, 3) &&
+        code[offset + 2] == OP_GET_LOCAL && code[offset + 4] == OP_ADD)
+    {
+      emit(&out, OP_ADD_LOCALS, line);
+      emit(&out, code[offset + 1], line);
+      emit(&out, code[offset + 3], line);
+      for (int i = 1; i < 5; i++)
+        newOffset[offset + i] = out.count;
+      offset += 5;
+      continue;
+    }
+    // OP_LESS/OP_GREATER, OP_JUMP_IF_FALSE, OP_POP
+    if ((instruction == OP_LESS || instruction == OP_GREATER) &&
+        fusable(&analysis, offset, 2) && code[offset + 1] == OP_JUMP_IF_FALSE)
+    {
+      int target = popOnBothPaths(&analysis, offset + 1);
+      if (target != -1)
+      {
+        dropTargetPop(&analysis, target);
+        analysis.jumpsTo[target + 1]++;
+        emitJumpTo(&out, instruction == OP_LESS ? OP_JUMP_IF_NOT_LESS : OP_JUMP_IF_NOT_GREATER,
+                   target + 1, line, jumpAt, jumpTo, &jumpCount);
+        for (int i = 1; i < 5; i++)
+          newOffset[offset + i] = out.count;
+        offset += 5;
+        continue;
+      }
+    }
+    // OP_JUMP_IF_FALSE, OP_POP
+    if (instruction == OP_JUMP_IF_FALSE)
+    {
+      int target = popOnBothPaths(&analysis, offset);
+      if (target != -1)
+      {
+        dropTargetPop(&analysis, target);
+        analysis.jumpsTo[target + 1]++;
+        emitJumpTo(&out, OP_JUMP_IF_FALSE_POP, target + 1, line, jumpAt, jumpTo, &jumpCount);
+        for (int i = 1; i < 4; i++)
+          newOffset[offset + i] = out.count;
+        offset += 4;
+        continue;
+      }
+    }
+    // OP_EQUAL/OP_LESS/OP_GREATER, OP_NOT
+    if ((instruction == OP_EQUAL || instruction == OP_LESS || instruction == OP_GREATER) &&
+        fusable(&analysis, offset, 2) && code[offset + 1] == OP_NOT)
+    {
+      uint8_t fused = instruction == OP_EQUAL  ? OP_NOT_EQUAL
+                      : instruction == OP_LESS ? OP_GREATER_EQUAL
+                                               : OP_LESS_EQUAL;
+      emit(&out, fused, line);
+      newOffset[offset + 1] = out.count;
+      offset += 2;
+      continue;
+    }
+
+    if (isForwardJump(instruction) || instruction == OP_LOOP)
+    {
+      emitJumpTo(&out, instruction, jumpTarget(chunk, offset), line, jumpAt, jumpTo, &jumpCount);
+    }
+    else
+    {
+      for (int i = 0; i < length; i++)
+        emit(&out, code[offset + i], getLine(chunk, offset + i));
+    }
+    offset += length;
+  }
+  newOffset[count] = out.count;
+
+  for (int i = 0; i < jumpCount; i++)
+  {
+    int at = jumpAt[i];
+    int target = newOffset[jumpTo[i]];
+    int jump = out.code[at] == OP_LOOP ? at + 3 - target : target - (at + 3);
+    out.code[at + 1] = (jump >> 8) & 0xff;
+    out.code[at + 2] = jump & 0xff;
+  }
+
+  FREE_ARRAY(int, jumpTo, count);
+  FREE_ARRAY(int, jumpAt, count);
+  FREE_ARRAY(int, newOffset, count + 1);
+  FREE_ARRAY(int, analysis.previous, count + 1);
+  FREE_ARRAY(bool, analysis.dropped, count + 1);
+  FREE_ARRAY(int, analysis.jumpsTo, count + 1);
+  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+  chunk->code = out.code;
+  chunk->count = out.count;
+  chunk->lines = out.lines;
+  chunk->lineCount = out.lineCount;
+  chunk->lineCapacity = lineCapacity;
+}
\ No newline at end of file
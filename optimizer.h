@@ -0,0 +1,8 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+
+void optimizeChunk(Chunk *chunk);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,155 @@
+#include <stdlib.h>
+
+#include "pool.h"
+
+// Size-class allocator for heap objects. Every class owns a list
+// of POOL_PAGE_SIZE pages, carves slots of its size off the newest
+// page and keeps freed slots on a free list, reused first.
+// Allocation and free are a few pointer moves, and objects made one
+// after another sit next to each other, which keeps walks over
+// vm->objects local.
+//
+// Callers pass the size on free, as they do to reallocate(), so a
+// slot needs no header and a page is never searched for. Pages are
+// only returned to the system by freePools().
+
+static int sizeClass(size_t size)
+{
+  return (int)((size + POOL_GRANULE - 1) / POOL_GRANULE) - 1;
+}
+static size_t slotSize(int index)
+{
+  return (size_t)(index + 1) * POOL_GRANULE;
+}
+static void addPage(Pool *pool, size_t slot)
+{
+  PoolPage *page = (PoolPage *)malloc(POOL_PAGE_SIZE);
+  if (page == NULL)
+    exit(1);
+  page->next = pool->pages;
+  pool->pages = page;
+  pool->pageCount++;
+  pool->bump = (char *)page + sizeof(PoolPage);
+  pool->bumpEnd = pool->bump + (POOL_PAGE_SIZE - sizeof(PoolPage)) / slot * slot;
+}
+void *poolAllocate(Pools *pools, size_t size)
+{
+  if (size == 0)
+    return NULL;
+  if (size > POOL_MAX_SIZE)
+  {
+    void *block = malloc(size);
+    if (block == NULL)
+      exit(1);
+    return block;
+  }
+  int index = sizeClass(size);
+  Pool *pool = &pools->classes[index];
+  pool->slotsInUse++;
+  pool->bytesInUse += size;
+  if (pool->freeList != NULL)
+  {
+    FreeSlot *slot = pool->freeList;
+    pool->freeList = slot->next;
+    return slot;
+  }
+  if (pool->bump == pool->bumpEnd)
+    addPage(pool, slotSize(index));
+  void *slot = pool->bump;
+  pool->bump += slotSize(index);
+  return slot;
+}
+void poolFree(Pools *pools, void *pointer, size_t size)
+{
+  if (pointer == NULL)
+    return;
+  if (size > POOL_MAX_SIZE)
+  {
+    free(pointer);
+    return;
+  }
+  Pool *pool = &pools->classes[sizeClass(size)];
+  pool->slotsInUse--;
+  pool->bytesInUse -= size;
+  FreeSlot *slot = (FreeSlot *)pointer;
+  slot->next = pool->freeList;
+  pool->freeList = slot;
+}
+void poolDefer(PoolReturns *returns, void *pointer, size_t size)
+{
+  if (pointer == NULL)
+    return;
+  if (size > POOL_MAX_SIZE)
+  {
+    free(pointer);
+    return;
+  }
+  int index = sizeClass(size);
+  FreeSlot *slot = (FreeSlot *)pointer;
+  slot->next = returns->heads[index];
+  if (returns->heads[index] == NULL)
+    returns->tails[index] = slot;
+  returns->heads[index] = slot;
+  returns->slots[index]++;
+  returns->bytes[index] += size;
+}
+void poolReturn(Pools *pools, PoolReturns *returns)
+{
+  for (int i = 0; i < POOL_CLASSES; i++)
+  {
+    if (returns->heads[i] == NULL)
+      continue;
+    Pool *pool = &pools->classes[i];
+    returns->tails[i]->next = pool->freeList;
+    pool->freeList = returns->heads[i];
+    pool->slotsInUse -= returns->slots[i];
+    pool->bytesInUse -= returns->bytes[i];
+  }
+  *returns = (PoolReturns){0};
+}
+void freePools(Pools *pools)
+{
+  for (int i = 0; i < POOL_CLASSES; i++)
+  {
+    Pool *pool = &pools->classes[i];
+    PoolPage *page = pool->pages;
+    while (page != NULL)
+    {
+      PoolPage *next = page->next;
+      free(page);
+      page = next;
+    }
+    *pool = (Pool){0};
+  }
+}
+// occupancy is the share of the slots carved from pages that are
+// in use, the rest sits on free lists. Rounding is the share of
+// the used slots' bytes lost to rounding sizes up to the class.
+void printPoolStats(Pools *pools, FILE *out)
+{
+  size_t totalPages = 0, totalCarved = 0, totalUsed = 0, totalRequested = 0;
+  fprintf(out, "%6s %6s %10s %10s %10s %9s\n",
+          "size", "pages", "slots", "in use", "free", "occupied");
+  for (int i = 0; i < POOL_CLASSES; i++)
+  {
+    Pool *pool = &pools->classes[i];
+    if (pool->pageCount == 0)
+      continue;
+    size_t slot = slotSize(i);
+    size_t perPage = (POOL_PAGE_SIZE - sizeof(PoolPage)) / slot;
+    size_t carved = perPage * pool->pageCount - (pool->bumpEnd - pool->bump) / slot;
+    fprintf(out, "%6zu %6d %10zu %10zu %10zu %8.1f%%\n", slot, pool->pageCount,
+            carved, pool->slotsInUse, carved - pool->slotsInUse,
+            100.0 * pool->slotsInUse / carved);
+    totalPages += pool->pageCount;
+    totalCarved += carved * slot;
+    totalUsed += pool->slotsInUse * slot;
+    totalRequested += pool->bytesInUse;
+  }
+  if (totalPages == 0)
+    return;
+  fprintf(out, "%zu KB in %zu pages, %.1f%% occupied, %.1f%% lost to rounding\n",
+          totalPages * POOL_PAGE_SIZE / 1024, totalPages,
+          100.0 * totalUsed / totalCarved,
+          totalUsed == 0 ? 0.0 : 100.0 * (totalUsed - totalRequested) / totalUsed);
+}
\ No newline at end of file
@@ -0,0 +1,63 @@
+#ifndef clox_pool_h
+#define clox_pool_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+// blocks up to POOL_MAX_SIZE bytes are served from one pool per
+// POOL_GRANULE-sized class, larger ones from malloc
+#define POOL_GRANULE 8
+#define POOL_MAX_SIZE 256
+#define POOL_PAGE_SIZE (64 * 1024)
+#define POOL_CLASSES (POOL_MAX_SIZE / POOL_GRANULE)
+
+typedef struct PoolPage
+{
+  struct PoolPage *next;
+} PoolPage;
+
+typedef struct FreeSlot
+{
+  struct FreeSlot *next;
+} FreeSlot;
+
+typedef struct
+{
+  FreeSlot *freeList;
+  // unused tail of the newest page
+  char *bump;
+  char *bumpEnd;
+  PoolPage *pages;
+  int pageCount;
+  // slots handed out and the bytes asked for by them
+  size_t slotsInUse;
+  size_t bytesInUse;
+} Pool;
+
+// one set of pools per VM, zeroed before first use
+typedef struct
+{
+  Pool classes[POOL_CLASSES];
+} Pools;
+
+// blocks freed where the pools must not be touched, like on
+// another thread, for poolReturn() to hand back in one go
+typedef struct
+{
+  FreeSlot *heads[POOL_CLASSES];
+  FreeSlot *tails[POOL_CLASSES];
+  size_t slots[POOL_CLASSES];
+  size_t bytes[POOL_CLASSES];
+} PoolReturns;
+
+void *poolAllocate(Pools *pools, size_t size);
+void poolFree(Pools *pools, void *pointer, size_t size);
+// poolFree() into returns, which starts out zeroed. Blocks
+// above POOL_MAX_SIZE go straight back to malloc
+void poolDefer(PoolReturns *returns, void *pointer, size_t size);
+void poolReturn(Pools *pools, PoolReturns *returns);
+void freePools(Pools *pools);
+void printPoolStats(Pools *pools, FILE *out);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "profiler.h"
+#include "vm.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/time.h>
+#define HAS_PROFILER
+#endif
+
+// Sampling profiler. A CPU-time interval timer raises SIGPROF,
+// whose handler only sets profileSampleDue. The VM checks the flag
+// at its safe points (OP_LOOP, OP_CALL and OP_RETURN) and calls
+// profileSample(), which walks vm->frames and counts the stack.
+// Checking only there keeps the interpreter loop free of any
+// per-instruction cost, at the price of attributing the innermost
+// frame to the loop, call or return nearest to where time is spent.
+//
+// Stacks are kept as collapsed-stack strings
+// ("<script>:12;fib:4;fib:3"), the input format of flamegraph.pl
+// and similar tools. A stack too deep for MAX_STACK_TEXT keeps its
+// innermost frames, the outer ones are cut to a "..." frame. Memory comes from malloc, not reallocate(),
+// so profiling never triggers or skews garbage collection.
+//
+// The timer, the flag and the counts are per process, so the
+// profiler is for hosts running one VM, like the clox command.
+
+#define MAX_STACK_TEXT 8192
+// longer function names are cut, so the innermost frame always fits
+#define MAX_NAME_TEXT 256
+
+volatile sig_atomic_t profileSampleDue = 0;
+
+typedef struct
+{
+  char *stack;
+  uint32_t hash;
+  int count;
+} StackEntry;
+
+typedef struct
+{
+  StackEntry *entries;
+  int capacity;
+  int count;
+  int samples;
+} Profile;
+
+static Profile profile;
+
+static uint32_t hashText(const char *text, int length)
+{
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; i++)
+  {
+    hash ^= (uint8_t)text[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+static StackEntry *findStack(StackEntry *entries, int capacity, const char *stack, uint32_t hash)
+{
+  uint32_t index = hash & (capacity - 1);
+  for (;;)
+  {
+    StackEntry *entry = &entries[index];
+    if (entry->stack == NULL ||
+        (entry->hash == hash && strcmp(entry->stack, stack) == 0))
+      return entry;
+    index = (index + 1) & (capacity - 1);
+  }
+}
+static void growProfile()
+{
+  int capacity = profile.capacity < 64 ? 64 : profile.capacity * 2;
+  StackEntry *entries = calloc(capacity, sizeof(StackEntry));
+  if (entries == NULL)
+    exit(1);
+  for (int i = 0; i < profile.capacity; i++)
+  {
+    StackEntry *entry = &profile.entries[i];
+    if (entry->stack == NULL)
+      continue;
+    *findStack(entries, capacity, entry->stack, entry->hash) = *entry;
+  }
+  free(profile.entries);
+  profile.entries = entries;
+  profile.capacity = capacity;
+}
+static void countStack(const char *stack, int length, int count)
+{
+  if (profile.count + 1 > profile.capacity * 3 / 4)
+    growProfile();
+  uint32_t hash = hashText(stack, length);
+  StackEntry *entry = findStack(profile.entries, profile.capacity, stack, hash);
+  if (entry->stack == NULL)
+  {
+    entry->stack = malloc(length + 1);
+    if (entry->stack == NULL)
+      exit(1);
+    memcpy(entry->stack, stack, length + 1);
+    entry->hash = hash;
+    profile.count++;
+  }
+  entry->count += count;
+}
+
+#ifdef HAS_PROFILER
+static void handleTimer(int signal)
+{
+  profileSampleDue = 1;
+}
+#endif
+
+bool startProfiler(int intervalMicros)
+{
+#ifdef HAS_PROFILER
+  profile.entries = NULL;
+  profile.capacity = 0;
+  profile.count = 0;
+  profile.samples = 0;
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handleTimer;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, NULL) != 0)
+    return false;
+  struct itimerval timer;
+  timer.it_interval.tv_sec = intervalMicros / 1000000;
+  timer.it_interval.tv_usec = intervalMicros % 1000000;
+  timer.it_value = timer.it_interval;
+  return setitimer(ITIMER_PROF, &timer, NULL) == 0;
+#else
+  fprintf(stderr, "Profiling is not supported on this platform.\n");
+  return false;
+#endif
+}
+// prepends "name:line" of each frame from the innermost call
+// out, so that the frame running is never the one cut off
+void profileSample()
+{
+  profileSampleDue = 0;
+  char stack[MAX_STACK_TEXT];
+  char *start = stack + MAX_STACK_TEXT - 1;
+  *start = '\0';
+  for (int i = vm->frameCount - 1; i >= 0; i--)
+  {
+    CallFrame *frame = &vm->frames[i];
+    ObjFunction *function = frame->function;
+    // ip is past the current instruction's first byte
+    size_t instruction = frame->ip - function->chunk.code - 1;
+    const char *name = function->name != NULL ? function->name->chars : "<script>";
+    char text[MAX_NAME_TEXT + 16];
+    int written = snprintf(text, sizeof(text), "%.*s:%d%s", MAX_NAME_TEXT, name,
+                           getLine(&function->chunk, (int)instruction),
+                           i < vm->frameCount - 1 ? ";" : "");
+    // room for "...;" is always left
+    if (written + 4 > start - stack)
+    {
+      start -= 4;
+      memcpy(start, "...;", 4);
+      break;
+    }
+    start -= written;
+    memcpy(start, text, written);
+  }
+  countStack(start, (int)(stack + MAX_STACK_TEXT - 1 - start), 1);
+  profile.samples++;
+}
+
+typedef struct
+{
+  const char *key;
+  int length;
+  int count;
+} HotSpot;
+
+static int compareHotSpots(const void *a, const void *b)
+{
+  return ((const HotSpot *)b)->count - ((const HotSpot *)a)->count;
+}
+// adds count to the hot spot named by key[0..length)
+static void addHotSpot(HotSpot *spots, int *spotCount, const char *key, int length, int count)
+{
+  for (int i = 0; i < *spotCount; i++)
+  {
+    if (spots[i].length == length && memcmp(spots[i].key, key, length) == 0)
+    {
+      spots[i].count += count;
+      return;
+    }
+  }
+  spots[*spotCount].key = key;
+  spots[*spotCount].length = length;
+  spots[*spotCount].count = count;
+  (*spotCount)++;
+}
+static void printHotSpots(const char *title, HotSpot *spots, int spotCount)
+{
+  qsort(spots, spotCount, sizeof(HotSpot), compareHotSpots);
+  fprintf(stderr, "%s\n", title);
+  for (int i = 0; i < spotCount && i < 10; i++)
+  {
+    fprintf(stderr, "  %5.1f%%  %.*s\n", 100.0 * spots[i].count / profile.samples,
+            spots[i].length, spots[i].key);
+  }
+}
+// writes the collapsed stacks to path and prints the
+// functions and lines with the most samples (self time)
+void stopProfiler(const char *path)
+{
+#ifdef HAS_PROFILER
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, NULL);
+  signal(SIGPROF, SIG_DFL);
+#endif
+  FILE *file = fopen(path, "w");
+  if (file == NULL)
+  {
+    fprintf(stderr, "Could not write profile \"%s\"\n", path);
+  }
+  HotSpot *functions = malloc(sizeof(HotSpot) * (profile.count + 1));
+  HotSpot *lines = malloc(sizeof(HotSpot) * (profile.count + 1));
+  int functionCount = 0;
+  int lineCount = 0;
+  for (int i = 0; i < profile.capacity; i++)
+  {
+    StackEntry *entry = &profile.entries[i];
+    if (entry->stack == NULL)
+      continue;
+    if (file != NULL)
+      fprintf(file, "%s %d\n", entry->stack, entry->count);
+    // the innermost frame gets the self time
+    const char *leaf = strrchr(entry->stack, ';');
+    leaf = leaf == NULL ? entry->stack : leaf + 1;
+    const char *colon = strrchr(leaf, ':');
+    addHotSpot(functions, &functionCount, leaf, (int)(colon - leaf), entry->count);
+    addHotSpot(lines, &lineCount, leaf, (int)strlen(leaf), entry->count);
+  }
+  if (file != NULL)
+    fclose(file);
+
+  fprintf(stderr, "== profile: %d samples, written to %s ==\n", profile.samples, path);
+  if (profile.samples > 0)
+  {
+    printHotSpots("functions:", functions, functionCount);
+    printHotSpots("lines:", lines, lineCount);
+  }
+
+  free(functions);
+  free(lines);
+  for (int i = 0; i < profile.capacity; i++)
+  {
+    free(profile.entries[i].stack);
+  }
+  free(profile.entries);
+  profile.entries = NULL;
+  profile.capacity = 0;
+  profile.count = 0;
+}
\ No newline at end of file
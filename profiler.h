@@ -0,0 +1,16 @@
+#ifndef clox_profiler_h
+#define clox_profiler_h
+
+#include <signal.h>
+
+#include "common.h"
+
+// set by the timer signal, the VM takes a sample at
+// its next safe point and clears it
+extern volatile sig_atomic_t profileSampleDue;
+
+bool startProfiler(int intervalMicros);
+void profileSample();
+void stopProfiler(const char *path);
+
+#endif
\ No newline at end of file
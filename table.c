@@ -7,96 +7,374 @@
 #include "value.h"
 #include "object.h"
 #include "table.h"
+#include "vm.h"
 
-#define TABLE_MAX_LOAD 0.75
+#if defined(__SSE2__) && !defined(TABLE_ROBIN_HOOD)
+#include <emmintrin.h>
+#endif
+
+// at most 7/8 of the entries are full (or deleted)
+#define MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+#define MIN_CAPACITY 16
+
+#ifdef TABLE_ROBIN_HOOD
+// Robin Hood linear probing. The control byte of an entry is 0 when
+// it is empty, else one more than its distance from the entry its
+// hash picks. An insert takes the place of any key closer to its own
+// home than the new key is, so a lookup can stop as soon as it meets
+// a key closer to home than the probe. A delete shifts the following
+// keys back by one until a key at home or an empty entry, so there
+// are no tombstones and probe lengths only depend on the load.
+
+#define CONTROL_EMPTY 0
+// distances are stored in a byte, a longer probe grows the table
+#define MAX_DISTANCE 254
+
+// Fibonacci hashing: the multiply spreads the low bits of
+// the hash, and the index is taken from the high bits
+static inline int homeIndex(uint32_t hash, int capacity)
+{
+  uint32_t spread = hash * 2654435769u;
+  return (int)(((uint64_t)spread * (uint32_t)capacity) >> 32);
+}
+// index of the entry holding key, or -1
+static int findIndex(Table *table, ObjString *key)
+{
+  int mask = table->capacity - 1;
+  int index = homeIndex(key->hash, table->capacity);
+  for (int distance = 0;; distance++)
+  {
+    uint8_t control = table->control[index];
+    if (control == CONTROL_EMPTY || control - 1 < distance)
+      return -1;
+    if (table->entries[index].key == key)
+      return index;
+    index = (index + 1) & mask;
+  }
+}
+// places a key that is not in the table yet. Returns 1 as it uses
+// up an empty entry, or -1 when that would take a probe longer than
+// MAX_DISTANCE. *entry is then the entry that is left over.
+static int placeEntry(uint8_t *control, Entry *entries, int capacity, Entry *entry)
+{
+  int mask = capacity - 1;
+  int index = homeIndex(entry->key->hash, capacity);
+  for (int distance = 0; distance <= MAX_DISTANCE; distance++)
+  {
+    if (control[index] == CONTROL_EMPTY)
+    {
+      control[index] = (uint8_t)(distance + 1);
+      entries[index] = *entry;
+      return 1;
+    }
+    if (control[index] - 1 < distance)
+    {
+      // the resident is closer to home, it moves on instead
+      Entry resident = entries[index];
+      int residentDistance = control[index] - 1;
+      entries[index] = *entry;
+      control[index] = (uint8_t)(distance + 1);
+      *entry = resident;
+      distance = residentDistance;
+    }
+    index = (index + 1) & mask;
+  }
+  return -1;
+}
+static void deleteIndex(Table *table, int index)
+{
+  int mask = table->capacity - 1;
+  int next = (index + 1) & mask;
+  // shift back every following key that is not at home
+  while (table->control[next] > 1)
+  {
+    table->entries[index] = table->entries[next];
+    table->control[index] = table->control[next] - 1;
+    index = next;
+    next = (next + 1) & mask;
+  }
+  table->control[index] = CONTROL_EMPTY;
+  table->entries[index].key = NULL;
+  table->entries[index].value = NIL_VAL;
+  table->count--;
+  table->growthLeft++;
+}
+// here we compare two strings char by char
+// the rest of the compiler can assume that strings having same
+// memory addresses are also the same
+ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t hash)
+{
+  if (table->count == 0)
+    return NULL;
+  int mask = table->capacity - 1;
+  int index = homeIndex(hash, table->capacity);
+  for (int distance = 0;; distance++)
+  {
+    uint8_t control = table->control[index];
+    if (control == CONTROL_EMPTY || control - 1 < distance)
+      return NULL;
+    ObjString *key = table->entries[index].key;
+    if (key->hash == hash && key->length == length &&
+        memcmp(key->chars, chars, length) == 0)
+      return key;
+    index = (index + 1) & mask;
+  }
+}
+// entries probed before the one of the key at index
+static int probeLength(Table *table, int index)
+{
+  return table->control[index] - 1;
+}
+
+#else
+// Open addressing in the style of SwissTable. Entries are split into
+// groups of GROUP_WIDTH, and a separate control byte per entry tells
+// whether it is empty, deleted, or full and with which 7-bit fragment
+// of its key's hash. A lookup starts at the group picked by the rest
+// of the hash and compares all control bytes of a group at once
+// (SSE2 when available), only looking at the keys whose fragment
+// matches. It stops at the first group with an empty slot, groups are
+// visited in triangular order. The capacity is a power of two, so
+// the group index is a mask, not a modulo.
+
+#define GROUP_WIDTH 16
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xfe
+
+static inline uint8_t hashTag(uint32_t hash)
+{
+  return hash & 0x7f;
+}
+static inline int firstGroup(uint32_t hash, int groupMask)
+{
+  return (int)(hash >> 7) & groupMask;
+}
+// bit i is set when control byte i of the group equals byte
+static inline uint32_t matchByte(const uint8_t *group, uint8_t byte)
+{
+#ifdef __SSE2__
+  __m128i control = _mm_loadu_si128((const __m128i *)group);
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char)byte)));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < GROUP_WIDTH; i++)
+    if (group[i] == byte)
+      mask |= 1u << i;
+  return mask;
+#endif
+}
+// bit i is set when slot i of the group is empty or deleted,
+// the only control bytes with the high bit set
+static inline uint32_t matchFree(const uint8_t *group)
+{
+#ifdef __SSE2__
+  return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < GROUP_WIDTH; i++)
+    if (group[i] & 0x80)
+      mask |= 1u << i;
+  return mask;
+#endif
+}
+static inline int lowestBit(uint32_t mask)
+{
+#ifdef __GNUC__
+  return __builtin_ctz(mask);
+#else
+  int bit = 0;
+  while ((mask & 1) == 0)
+  {
+    mask >>= 1;
+    bit++;
+  }
+  return bit;
+#endif
+}
+// index of the entry holding key, or -1
+static int findIndex(Table *table, ObjString *key)
+{
+  int groupMask = table->capacity / GROUP_WIDTH - 1;
+  int group = firstGroup(key->hash, groupMask);
+  uint8_t tag = hashTag(key->hash);
+  for (int step = 1;; step++)
+  {
+    const uint8_t *control = &table->control[group * GROUP_WIDTH];
+    for (uint32_t match = matchByte(control, tag); match != 0; match &= match - 1)
+    {
+      int index = group * GROUP_WIDTH + lowestBit(match);
+      if (table->entries[index].key == key)
+        return index;
+    }
+    if (matchByte(control, CONTROL_EMPTY) != 0)
+      return -1;
+    group = (group + step) & groupMask;
+  }
+}
+// places a key that is not in the table yet in the first empty or
+// deleted entry on its probe sequence. Returns 1 if that used up
+// an empty entry, 0 for a tombstone.
+static int placeEntry(uint8_t *control, Entry *entries, int capacity, Entry *entry)
+{
+  int groupMask = capacity / GROUP_WIDTH - 1;
+  int group = firstGroup(entry->key->hash, groupMask);
+  for (int step = 1;; step++)
+  {
+    uint32_t free = matchFree(&control[group * GROUP_WIDTH]);
+    if (free != 0)
+    {
+      int index = group * GROUP_WIDTH + lowestBit(free);
+      int wasEmpty = control[index] == CONTROL_EMPTY;
+      control[index] = hashTag(entry->key->hash);
+      entries[index] = *entry;
+      return wasEmpty;
+    }
+    group = (group + step) & groupMask;
+  }
+}
+static void deleteIndex(Table *table, int index)
+{
+  // a lookup that reached this group stops at an empty slot in it
+  // anyway, so no key can be behind it and the slot can be empty
+  // again. Otherwise it has to stay a tombstone.
+  const uint8_t *group = &table->control[index / GROUP_WIDTH * GROUP_WIDTH];
+  if (matchByte(group, CONTROL_EMPTY) != 0)
+  {
+    table->control[index] = CONTROL_EMPTY;
+    table->growthLeft++;
+  }
+  else
+  {
+    table->control[index] = CONTROL_DELETED;
+  }
+  table->entries[index].key = NULL;
+  table->entries[index].value = NIL_VAL;
+  table->count--;
+}
+// here we compare two strings char by char
+// the rest of the compiler can assume that strings having same
+// memory addresses are also the same
+ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t hash)
+{
+  if (table->count == 0)
+    return NULL;
+  int groupMask = table->capacity / GROUP_WIDTH - 1;
+  int group = firstGroup(hash, groupMask);
+  uint8_t tag = hashTag(hash);
+  for (int step = 1;; step++)
+  {
+    const uint8_t *control = &table->control[group * GROUP_WIDTH];
+    // the characters are only compared for keys
+    // whose hash fragment matches
+    for (uint32_t match = matchByte(control, tag); match != 0; match &= match - 1)
+    {
+      ObjString *key = table->entries[group * GROUP_WIDTH + lowestBit(match)].key;
+      if (key->hash == hash && key->length == length &&
+          memcmp(key->chars, chars, length) == 0)
+        return key;
+    }
+    if (matchByte(control, CONTROL_EMPTY) != 0)
+      return NULL;
+    group = (group + step) & groupMask;
+  }
+}
+// groups probed before the one of the key at index
+static int probeLength(Table *table, int index)
+{
+  int groupMask = table->capacity / GROUP_WIDTH - 1;
+  int group = firstGroup(table->entries[index].key->hash, groupMask);
+  int length = 0;
+  for (int step = 1; group != index / GROUP_WIDTH; step++)
+  {
+    group = (group + step) & groupMask;
+    length++;
+  }
+  return length;
+}
+#endif
 
 void initTable(Table *table)
 {
   table->count = 0;
   table->capacity = 0;
+  table->growthLeft = 0;
+  table->control = NULL;
   table->entries = NULL;
 }
 void freeTable(Table *table)
 {
+  FREE_ARRAY(uint8_t, table->control, table->capacity);
   FREE_ARRAY(Entry, table->entries, table->capacity);
   initTable(table);
 }
-static Entry *findEntry(Entry *entries, int capacity, ObjString *key)
+static void adjustCapacity(Table *table, int capacity)
 {
-  uint32_t index = key->hash % (capacity);
-  debugLog("\nFinding index: %u : ", index);
-  Entry *tombstone = NULL;
+  uint8_t *control;
+  Entry *entries;
   for (;;)
   {
-    Entry *entry = &entries[index];
-    if (entry->key == NULL)
+    control = ALLOCATE(uint8_t, capacity);
+    entries = ALLOCATE(Entry, capacity);
+    memset(control, CONTROL_EMPTY, capacity);
+    for (int i = 0; i < capacity; i++)
     {
-      // debugLog("NULL ");
-      if (IS_NIL(entry->value))
-      {
-        // means this is an empty entry, not
-        // a tombstone
-        return tombstone != NULL ? tombstone : entry;
-      }
-      else
-      {
-        // found a tombstone
-        if (tombstone == NULL)
-          tombstone = entry;
-      }
+      entries[i].key = NULL;
+      entries[i].value = NIL_VAL;
     }
-    else if (entry->key == key)
+    // copy existing keys to new entries array,
+    // tombstones are not copied
+    bool placed = true;
+    for (int i = 0; i < table->capacity && placed; i++)
     {
-      return entry;
+      Entry entry = table->entries[i];
+      if (entry.key != NULL)
+        placed = placeEntry(control, entries, capacity, &entry) >= 0;
     }
-    index = (index + 1) % capacity;
-  }
-}
-static void adjustCapacity(Table *table, int capacity)
-{
-  Entry *entries = ALLOCATE(Entry, capacity);
-  for (int i = 0; i < capacity; i++)
-  {
-    entries[i].key = NULL;
-    entries[i].value = NIL_VAL;
-  }
-  // copy existing keys to new entries array
-  table->count = 0;
-  // we must not copy tombstones
-  for (int i = 0; i < table->capacity; i++)
-  {
-    Entry *entry = &table->entries[i];
-    if (entry->key == NULL)
-      continue;
-    Entry *dest = findEntry(entries, capacity, entry->key);
-    dest->key = entry->key;
-    dest->value = entry->value;
-    table->count++;
+    if (placed)
+      break;
+    // a probe got too long, try twice the size
+    FREE_ARRAY(uint8_t, control, capacity);
+    FREE_ARRAY(Entry, entries, capacity);
+    capacity *= 2;
   }
-  // delete old array
+  // delete old arrays
+  FREE_ARRAY(uint8_t, table->control, table->capacity);
   FREE_ARRAY(Entry, table->entries, table->capacity);
+  table->control = control;
   table->entries = entries;
   table->capacity = capacity;
+  table->growthLeft = MAX_LOAD(capacity) - table->count;
 }
 // Sets a key to value, overwriting if it exists
 // returns if the key didn't exist already
 bool tableSet(Table *table, ObjString *key, Value value)
 {
-  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD)
+  int index = table->count == 0 ? -1 : findIndex(table, key);
+  if (index >= 0)
+  {
+    snapshotBarrier(table->entries[index].value);
+    table->entries[index].value = value;
+    return false;
+  }
+  if (table->growthLeft == 0)
   {
-    int capacity = GROW_CAPACITY(table->capacity);
+    // mostly tombstones: rehash in place, otherwise grow
+    int capacity = table->capacity < MIN_CAPACITY ? MIN_CAPACITY : table->capacity;
+    if (table->count >= MAX_LOAD(capacity) / 2)
+      capacity *= 2;
     adjustCapacity(table, capacity);
   }
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  bool isNewKey = entry->key == NULL;
-  // increase count only if we use an empty bucket
-  // and not a tombstone
-  if (isNewKey && IS_NIL(entry->value))
-    table->count++;
-
-  entry->key = key;
-  entry->value = value;
-  return isNewKey;
+  Entry entry = {key, value};
+  int usedEmpty = placeEntry(table->control, table->entries, table->capacity, &entry);
+  while (usedEmpty < 0)
+  {
+    // the entry left over goes into a bigger table
+    adjustCapacity(table, table->capacity * 2);
+    usedEmpty = placeEntry(table->control, table->entries, table->capacity, &entry);
+  }
+  table->growthLeft -= usedEmpty;
+  table->count++;
+  return true;
 }
 void tableAddAll(Table *from, Table *to)
 {
@@ -115,10 +393,10 @@ bool tableGet(Table *table, ObjString *key, Value *value)
 {
   if (table->count == 0)
     return false;
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL)
+  int index = findIndex(table, key);
+  if (index < 0)
     return false;
-  *value = entry->value;
+  *value = table->entries[index].value;
   return true;
 }
 // returns if key was deleted
@@ -126,37 +404,51 @@ bool tableDelete(Table *table, ObjString *key)
 {
   if (table->count == 0)
     return false;
-  // find entry
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL)
+  int index = findIndex(table, key);
+  if (index < 0)
     return false;
-  // place tombstone in the entry
-  entry->key = NULL;
-  entry->value = BOOL_VAL(true);
+  deleteIndex(table, index);
   return true;
 }
-// here we compare two strings char by char
-// the rest of the compiler can assume that strings having same
-// memory addresses are also the same
-ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t hash)
+// counts the keys by the probe length it takes to find them, in
+// entries for Robin Hood and in groups otherwise. The last of the
+// buckets also counts every longer probe. Returns the longest probe.
+int tableProbeLengths(Table *table, int *histogram, int buckets)
 {
-  if (table->count == 0)
-    return NULL;
-  uint32_t index = hash % table->capacity;
-  for (;;)
+  int longest = 0;
+  for (int i = 0; i < buckets; i++)
+    histogram[i] = 0;
+  for (int i = 0; i < table->capacity; i++)
   {
-    Entry *entry = &table->entries[index];
-    if (entry->key == NULL)
-    {
-      // stop if empty, non-tombstone
-      if (IS_NIL(entry->value))
-        return NULL;
-    }
-    else if (entry->key->length == length && entry->key->hash == hash && memcmp(entry->key->chars, chars, length) == 0)
+    if (table->entries[i].key == NULL)
+      continue;
+    int length = probeLength(table, i);
+    if (length > longest)
+      longest = length;
+    histogram[length < buckets ? length : buckets - 1]++;
+  }
+  return longest;
+}
+// drops the entries whose keys were not marked,
+// used to make the string intern table weak
+void tableRemoveWhite(Table *table)
+{
+  for (int i = 0; i < table->capacity; i++)
+  {
+    Entry *entry = &table->entries[i];
+    // a backward shift can move an unvisited key into entry i
+    while (entry->key != NULL && !hasFlag(&entry->key->obj, OBJ_MARKED))
     {
-      // found the string in hash table
-      return entry->key;
+      deleteIndex(table, i);
     }
-    index = (index + 1) % table->capacity;
+  }
+}
+void markTable(Table *table)
+{
+  for (int i = 0; i < table->capacity; i++)
+  {
+    Entry *entry = &table->entries[i];
+    markObject((Obj *)entry->key);
+    markValue(entry->value);
   }
 }
\ No newline at end of file
@@ -14,6 +14,12 @@ typedef struct
 {
   int count;
   int capacity;
+  // inserts left before a resize, tombstones use them up too
+  int growthLeft;
+  // one byte per entry, empty, deleted or the low
+  // 7 bits of the hash of the entry's key
+  uint8_t *control;
+  // the key of an empty or deleted entry is NULL
   Entry *entries;
 } Table;
 
@@ -24,5 +30,8 @@ bool tableSet(Table *table, ObjString *key, Value value);
 bool tableDelete(Table *table, ObjString *key);
 void tableAddAll(Table *from, Table *to);
 ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t hash);
+void tableRemoveWhite(Table *table);
+void markTable(Table *table);
+int tableProbeLengths(Table *table, int *histogram, int buckets);
 
 #endif
\ No newline at end of file
@@ -31,6 +31,24 @@ void freeValueArray(ValueArray *array)
 }
 void printValue(Value value)
 {
+#ifdef NAN_BOXING
+  if (IS_BOOL(value))
+  {
+    printf(AS_BOOL(value) ? "true" : "false");
+  }
+  else if (IS_NIL(value))
+  {
+    printf("nil");
+  }
+  else if (IS_NUMBER(value))
+  {
+    printf("%g", AS_NUMBER(value));
+  }
+  else if (IS_OBJ(value))
+  {
+    printObject(value);
+  }
+#else
   switch (value.type)
   {
   case VAL_BOOL:
@@ -45,10 +63,20 @@ void printValue(Value value)
   case VAL_OBJ:
     printObject(value);
     break;
+  case VAL_UNDEFINED:
+    printf("undefined");
+    break;
   }
+#endif
 }
 bool valuesEqual(Value a, Value b)
 {
+#ifdef NAN_BOXING
+  // NaN != NaN still has to hold for numbers
+  if (IS_NUMBER(a) && IS_NUMBER(b))
+    return AS_NUMBER(a) == AS_NUMBER(b);
+  return a == b;
+#else
   if (a.type != b.type)
     return false;
   switch (a.type)
@@ -56,6 +84,7 @@ bool valuesEqual(Value a, Value b)
   case VAL_BOOL:
     return AS_BOOL(a) == AS_BOOL(b);
   case VAL_NIL:
+  case VAL_UNDEFINED:
     return true;
   case VAL_NUMBER:
     return AS_NUMBER(a) == AS_NUMBER(b);
@@ -71,4 +100,5 @@ bool valuesEqual(Value a, Value b)
   default:
     return false; // Unreachable.
   }
+#endif
 }
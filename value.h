@@ -1,17 +1,79 @@
 #ifndef clox_value_h
 #define clox_value_h
 
+#include <string.h>
+
 #include "common.h"
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+#ifdef NAN_BOXING
+
+// a Value is a single 64-bit word. Any bit pattern that is not
+// a quiet NaN is a double; the quiet NaN space holds the rest:
+//   nil, true, false -> QNAN with a tag in the lowest bits
+//   Obj*             -> QNAN with the sign bit set, pointer in the low 48 bits
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL 1       // 001
+#define TAG_FALSE 2     // 010
+#define TAG_TRUE 3      // 011
+#define TAG_UNDEFINED 4 // 100
+
+typedef uint64_t Value;
+
+#define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
+
+// true and false differ only in the lowest bit, so or-ing
+// with 1 maps both of them to TRUE_VAL
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#define IS_NUMBER(value) (((value)&QNAN) != QNAN)
+#define IS_OBJ(value) \
+  (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_NUMBER(value) valueToNum(value)
+#define AS_OBJ(value) \
+  ((Obj *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+// internal marker for a global slot that has not been
+// defined yet, never visible to Lox code
+#define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define NUMBER_VAL(num) numToValue(num)
+#define OBJ_VAL(obj) \
+  (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+
+// type punning through memcpy, which compilers turn
+// into a plain register move
+static inline double valueToNum(Value value)
+{
+  double num;
+  memcpy(&num, &value, sizeof(Value));
+  return num;
+}
+static inline Value numToValue(double num)
+{
+  Value value;
+  memcpy(&value, &num, sizeof(double));
+  return value;
+}
+
+#else
+
 typedef enum
 {
   VAL_BOOL,
   VAL_NIL,
   VAL_NUMBER,
   VAL_OBJ,
+  VAL_UNDEFINED,
 } ValueType;
 // tagged union
 typedef struct
@@ -29,6 +91,7 @@ typedef struct
 #define IS_NIL(value) ((value).type == VAL_NIL)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 #define AS_OBJ(value) ((value).as.obj)
 #define AS_BOOL(value) ((value).as.boolean)
@@ -39,6 +102,11 @@ typedef struct
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj *)object}})
+// internal marker for a global slot that has not been
+// defined yet, never visible to Lox code
+#define UNDEFINED_VAL ((Value){VAL_UNDEFINED, {.number = 0}})
+
+#endif
 
 // typedef double Value;
 /**
@@ -1,26 +1,38 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "common.h"
+#include "cache.h"
 #include "compiler.h"
+#include "jit.h"
 #include "vm.h"
 #include "debug.h"
 #include "object.h"
 #include "memory.h"
-VM vm;
-static Value clockNative(int argCount, Value *args)
+#include "profiler.h"
+#include "workers.h"
+THREAD_LOCAL VM *vm = NULL;
+static bool clockNative(VM *vm, int argCount)
 {
-  return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+  push(NUMBER_VAL((double)clock() / CLOCKS_PER_SEC));
+  return true;
 }
 static void resetStack()
 {
-  vm.stackTop = vm.stack;
-  vm.frameCount = 0;
-  vm.openUpvalues = NULL;
+  vm->stackTop = vm->stack;
+  vm->apiBase = 0;
+  vm->frameCount = 0;
 }
-static void runtimeError(const char *format, ...)
+static void closeUpvalues(Value *last);
+// frames printed at each end of a stack trace, a runaway
+// recursion would otherwise print every one of its frames
+#define TRACE_FRAMES 10
+// prints the message and a stack trace. The caller returns an
+// error up to callAndRun(), which unwinds the stack
+void runtimeError(const char *format, ...)
 {
   va_list args;
   va_start(args, format);
@@ -28,13 +40,18 @@ static void runtimeError(const char *format, ...)
   va_end(args);
   fputs("\n", stderr);
   // stack trace
-  for (int i = vm.frameCount - 1; i >= 0; i--)
+  for (int i = vm->frameCount - 1; i >= 0; i--)
   {
-    CallFrame *frame = &vm.frames[i];
-    ObjFunction *function = frame->closure->function;
+    if (i == vm->frameCount - 1 - TRACE_FRAMES && i > TRACE_FRAMES)
+    {
+      fprintf(stderr, "... %d frames omitted\n", i - TRACE_FRAMES + 1);
+      i = TRACE_FRAMES - 1;
+    }
+    CallFrame *frame = &vm->frames[i];
+    ObjFunction *function = frame->function;
     // instruction where error occurred
     size_t instruction = frame->ip - function->chunk.code - 1;
-    fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+    fprintf(stderr, "[line %d] in ", getLine(&function->chunk, (int)instruction));
     if (function->name == NULL)
     {
       fprintf(stderr, "script\n");
@@ -44,68 +61,206 @@ static void runtimeError(const char *format, ...)
       fprintf(stderr, "%s()\n", function->name->chars);
     }
   }
-  resetStack();
   return;
-  // CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  // CallFrame *frame = &vm->frames[vm->frameCount - 1];
   // size_t instruction = frame->ip - frame->function->chunk.code - 1;
   // int line = frame->function->chunk.lines[instruction];
   // fprintf(stderr, "[line %d] in script\n", line);
 }
-static void defineNative(const char *name, NativeFn function, int arity)
+void defineNative(const char *name, NativeFn function, int arity)
 {
   push(OBJ_VAL(copyString(name, (int)strlen(name))));
   push(OBJ_VAL(newNative(function, arity)));
-  tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+  int slot = globalSlot(AS_STRING(vm->stackTop[-2]));
+  snapshotBarrier(vm->globalValues.values[slot]);
+  vm->globalValues.values[slot] = vm->stackTop[-1];
+  globalWriteBarrier(slot, vm->stackTop[-1]);
   pop();
   pop();
 }
-void initVM()
+// allocates a VM and makes it the current one
+VM *newVM()
 {
+  vm = (VM *)calloc(1, sizeof(VM));
+  if (vm == NULL)
+    exit(1);
+  // the stacks are not allocated through reallocate(), growing
+  // them must not start a collection while a value being pushed
+  // is not rooted yet
+  vm->frameCapacity = FRAMES_INITIAL;
+  vm->framesMax = FRAMES_MAX;
+  vm->frames = (CallFrame *)malloc(sizeof(CallFrame) * vm->frameCapacity);
+  vm->stack = (Value *)malloc(sizeof(Value) * STACK_INITIAL);
+  vm->openSlots = (ObjUpvalue **)calloc(STACK_INITIAL, sizeof(ObjUpvalue *));
+  if (vm->frames == NULL || vm->stack == NULL || vm->openSlots == NULL)
+    exit(1);
+  vm->stackEnd = vm->stack + STACK_INITIAL;
   resetStack();
-  vm.objects = NULL;
-  initTable(&vm.globals);
-  initTable(&vm.strings);
+  for (int i = 0; i < GC_REGIONS; i++)
+    vm->objects[i] = NULL;
+  vm->promoteRegion = 0;
+  vm->youngObjects = NULL;
+  vm->youngBytes = 0;
+  vm->minorCollection = false;
+  vm->minorCollections = 0;
+  // one per processor, up to GC_THREADS_DEFAULT
+  vm->gcThreads = 1;
+#ifdef PARALLEL_GC
+  vm->gcThreads = processorCount();
+  if (vm->gcThreads > GC_THREADS_DEFAULT)
+    vm->gcThreads = GC_THREADS_DEFAULT;
+#endif
+  vm->gcWorkers = NULL;
+  vm->gcPauseMicros = 0;
+  vm->gcPhase = GC_IDLE;
+  vm->stepBytes = 0;
+  for (int i = 0; i < GC_REGIONS; i++)
+    vm->unswept[i] = NULL;
+  vm->sweepRegion = 0;
+  memset(vm->pauses, 0, sizeof(vm->pauses));
+  vm->jitEnabled = false;
+  vm->perfMap = false;
+  vm->rememberedCount = 0;
+  vm->rememberedCapacity = 0;
+  vm->remembered = NULL;
+  memset(vm->globalCards, 0, sizeof(vm->globalCards));
+  vm->globalNamesDirty = false;
+  vm->bytesAllocated = 0;
+  vm->nextGC = 1024 * 1024;
+  vm->grayCount = 0;
+  vm->grayCapacity = 0;
+  vm->grayStack = NULL;
+  initValueArray(&vm->globalValues);
+  initTable(&vm->globalNames);
+  initTable(&vm->strings);
+  vm->cacheMappings = NULL;
+  vm->cacheMappingCount = 0;
   defineNative("clock", clockNative, 0);
+  return vm;
 }
+// frees the current VM, which leaves none current
 void freeVM()
 {
-  freeTable(&vm.globals);
-  freeTable(&vm.strings);
+  freeValueArray(&vm->globalValues);
+  freeTable(&vm->globalNames);
+  freeTable(&vm->strings);
   freeObjects();
+  // no function in a cache file is left to run
+  closeCaches();
+  free(vm->frames);
+  free(vm->stack);
+  free(vm->openSlots);
+  free(vm);
+  vm = NULL;
 }
-
+// moves the value stack to a buffer with room for at least
+// needed more values and rebases every pointer into it
+static NOINLINE void growStack(int needed)
+{
+  int count = (int)(vm->stackTop - vm->stack);
+  int capacity = (int)(vm->stackEnd - vm->stack);
+  while (capacity - count < needed)
+    capacity *= 2;
+  Value *stack = (Value *)malloc(sizeof(Value) * capacity);
+  ObjUpvalue **openSlots = (ObjUpvalue **)calloc(capacity, sizeof(ObjUpvalue *));
+  if (stack == NULL || openSlots == NULL)
+    exit(1);
+  memcpy(stack, vm->stack, sizeof(Value) * count);
+  memcpy(openSlots, vm->openSlots, sizeof(ObjUpvalue *) * count);
+  for (int i = 0; i < vm->frameCount; i++)
+    vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+  for (int i = 0; i < count; i++)
+  {
+    if (openSlots[i] != NULL)
+      openSlots[i]->location = stack + i;
+  }
+  free(vm->stack);
+  free(vm->openSlots);
+  vm->openSlots = openSlots;
+  vm->stack = stack;
+  vm->stackTop = stack + count;
+  vm->stackEnd = stack + capacity;
+}
+// run() pushes with the unchecked PUSH(), every other
+// caller may be past the space reserved by call()
 void push(Value value)
 {
-  *vm.stackTop = value;
-  vm.stackTop++;
+  if (vm->stackTop == vm->stackEnd)
+    growStack(1);
+  *vm->stackTop = value;
+  vm->stackTop++;
 }
 Value pop()
 {
-  vm.stackTop--;
-  return *vm.stackTop;
+  vm->stackTop--;
+  return *vm->stackTop;
+}
+// returns the slot of a global variable, giving it
+// a new undefined slot the first time the name is seen
+int globalSlot(ObjString *name)
+{
+  Value slot;
+  if (tableGet(&vm->globalNames, name, &slot))
+    return (int)AS_NUMBER(slot);
+  push(OBJ_VAL(name));
+  writeValueArray(&vm->globalValues, UNDEFINED_VAL);
+  int index = vm->globalValues.count - 1;
+  tableSet(&vm->globalNames, name, NUMBER_VAL((double)index));
+  if (!hasFlag(&name->obj, OBJ_OLD))
+    vm->globalNamesDirty = true;
+  pop();
+  return index;
+}
+// reverse lookup of globalSlot(), only used for error messages
+ObjString *globalName(int slot)
+{
+  for (int i = 0; i < vm->globalNames.capacity; i++)
+  {
+    Entry *entry = &vm->globalNames.entries[i];
+    if (entry->key != NULL && AS_NUMBER(entry->value) == slot)
+      return entry->key;
+  }
+  return NULL;
 }
 // get Value at distance depth from
 // top of stack
 Value peek(int distance)
 {
-  return vm.stackTop[-1 - distance];
+  return vm->stackTop[-1 - distance];
 }
-static bool call(ObjClosure *closure, int argCount)
+// upvalues is NULL when a script is called,
+// which runs without a closure
+static bool call(ObjFunction *function, Value *upvalues, int argCount)
 {
-  if (argCount != closure->function->arity)
+  if (argCount != function->arity)
   {
-    runtimeError("Expected %d arguments, got %d", closure->function->arity, argCount);
+    runtimeError("Expected %d arguments, got %d", function->arity, argCount);
     return false;
   }
-  if (vm.frameCount == FRAMES_MAX)
+  int slots = function->stackSlots;
+  if (vm->frameCount >= vm->framesMax || vm->stackTop - vm->stack + slots > STACK_MAX)
   {
     runtimeError("Stack overflow");
     return false;
   }
-  CallFrame *frame = &vm.frames[vm.frameCount++];
-  frame->closure = closure;
-  frame->ip = closure->function->chunk.code;
-  frame->slots = vm.stackTop - argCount - 1;
+  if (vm->frameCount == vm->frameCapacity)
+  {
+    // callers re-read their frame pointer after a call
+    vm->frameCapacity *= 2;
+    vm->frames = (CallFrame *)realloc(vm->frames, sizeof(CallFrame) * vm->frameCapacity);
+    if (vm->frames == NULL)
+      exit(1);
+  }
+  // reserve everything the function can push, so
+  // run() never has to check the stack capacity
+  if (vm->stackEnd - vm->stackTop < slots)
+    growStack(slots);
+  CallFrame *frame = &vm->frames[vm->frameCount++];
+  frame->function = function;
+  frame->upvalues = upvalues;
+  frame->ip = function->chunk.code;
+  frame->slots = vm->stackTop - argCount - 1;
+  frame->openUpvalues = 0;
   return true;
 }
 static bool callValue(Value callee, int argCount)
@@ -114,10 +269,10 @@ static bool callValue(Value callee, int argCount)
   {
     switch (OBJ_TYPE(callee))
     {
-    // case OBJ_FUNCTION:
-    //   return call(AS_FUNCTION(callee), argCount);
+    case OBJ_FUNCTION:
+      return call(AS_FUNCTION(callee), NULL, argCount);
     case OBJ_CLOSURE:
-      return call(AS_CLOSURE(callee), argCount);
+      return call(AS_CLOSURE(callee)->function, AS_CLOSURE(callee)->upvalues, argCount);
     case OBJ_NATIVE:
     {
       ObjNative *nativeObj = AS_NATIVE_OBJ(callee);
@@ -127,8 +282,18 @@ static bool callValue(Value callee, int argCount)
         runtimeError("Expected %d arguments, but got %d", nativeObj->arity, argCount);
         return false;
       }
-      Value result = native(argCount, vm.stackTop - argCount);
-      vm.stackTop -= argCount - 1;
+      // the native sees its arguments from API index 0 and may
+      // push, grow the stack or call back into the VM, so the
+      // stack is addressed by index until it returns
+      int savedBase = vm->apiBase;
+      int base = (int)(vm->stackTop - vm->stack) - argCount;
+      vm->apiBase = base;
+      bool ok = native(vm, argCount);
+      vm->apiBase = savedBase;
+      if (!ok)
+        return false;
+      Value result = vm->stackTop > vm->stack + base + argCount ? vm->stackTop[-1] : NIL_VAL;
+      vm->stackTop = vm->stack + base - 1;
       push(result);
       return true;
     }
@@ -139,38 +304,34 @@ static bool callValue(Value callee, int argCount)
   runtimeError("Can only call functions and classes.");
   return false;
 }
-static ObjUpvalue *captureUpvalue(Value *local)
+// the open upvalue of a local of the running frame,
+// looked up by its stack slot
+static ObjUpvalue *captureUpvalue(CallFrame *frame, Value *local)
 {
-  ObjUpvalue *prevUpvalue = NULL;
-  ObjUpvalue *upvalue = vm.openUpvalues;
-  while (upvalue != NULL && upvalue->location > local)
-  {
-    prevUpvalue = upvalue;
-    upvalue = upvalue->next;
-  }
-  if (upvalue != NULL && upvalue->location == local)
-  {
-    return upvalue;
-  }
-  ObjUpvalue *createdUpvalue = newUpvalue(local);
-  if (prevUpvalue == NULL)
-  {
-    vm.openUpvalues = createdUpvalue;
-  }
-  else
-  {
-    prevUpvalue->next = createdUpvalue;
-  }
-  return createdUpvalue;
+  ObjUpvalue **open = &vm->openSlots[local - vm->stack];
+  if (*open != NULL)
+    return *open;
+  // a collection in newUpvalue() cannot move the stack
+  *open = newUpvalue(local);
+  frame->openUpvalues++;
+  return *open;
 }
+static void closeUpvalue(ObjUpvalue **open)
+{
+  ObjUpvalue *upvalue = *open;
+  upvalue->closed = *upvalue->location;
+  writeValueBarrier((Obj *)upvalue, upvalue->closed);
+  upvalue->location = &upvalue->closed;
+  *open = NULL;
+}
+// closes the open upvalues of the slots from last up
 static void closeUpvalues(Value *last)
 {
-  while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last)
+  ObjUpvalue **end = &vm->openSlots[vm->stackTop - vm->stack];
+  for (ObjUpvalue **open = &vm->openSlots[last - vm->stack]; open < end; open++)
   {
-    ObjUpvalue *upvalue = vm.openUpvalues;
-    upvalue->closed = *upvalue->location;
-    upvalue->location = &upvalue->closed;
-    vm.openUpvalues = upvalue->next;
+    if (*open != NULL)
+      closeUpvalue(open);
   }
 }
 // only false and nil are falsey and all others are true
@@ -178,295 +339,647 @@ static bool isFalsey(Value value)
 {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
-static void concatenate()
+// a rope that was flattened already is
+// joined by its string
+static Obj *flatIfAny(Obj *object)
 {
-  ObjString *b = AS_STRING(pop());
-  ObjString *a = AS_STRING(pop());
-  int length = a->length + b->length;
-  char *chars = ALLOCATE(char, length + 1); // with terminating \0
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
-  ObjString *result = takeString(chars, length);
+  if (objType(object) == OBJ_ROPE && ((ObjRope *)object)->flat != NULL)
+    return (Obj *)((ObjRope *)object)->flat;
+  return object;
+}
+// false without touching the stack when the result
+// would be longer than STRING_LENGTH_MAX
+static bool concatenate()
+{
+  // operands stay on the stack until the result
+  // exists, allocating may collect
+  Obj *b = flatIfAny(AS_OBJ(peek(0)));
+  Obj *a = flatIfAny(AS_OBJ(peek(1)));
+  // ropes double a string in O(1), the sum can overflow an int
+  int64_t length = (int64_t)textLength(a) + textLength(b);
+  if (length > STRING_LENGTH_MAX)
+    return false;
+  Obj *result;
+  if (length >= ROPE_MIN_LENGTH)
+  {
+    // O(1), the characters are only copied when needed
+    result = (Obj *)newRope(a, b, (int)length);
+  }
+  else
+  {
+    // every rope is longer, so both are strings, joined on the
+    // C stack so an interned result costs no allocation
+    ObjString *left = (ObjString *)a;
+    ObjString *right = (ObjString *)b;
+    char chars[ROPE_MIN_LENGTH];
+    memcpy(chars, left->chars, left->length);
+    memcpy(chars + left->length, right->chars, right->length);
+    result = (Obj *)copyString(chars, (int)length);
+  }
+  pop();
+  pop();
   push(OBJ_VAL(result));
+  return true;
+}
+// compares the two values on top of the stack. A rope equals
+// the string it flattens to, ropes are only flattened when
+// the lengths match
+static bool topValuesEqual()
+{
+  Value b = peek(0);
+  Value a = peek(1);
+  if (valuesEqual(a, b))
+    return true;
+  if (!IS_ROPE(a) && !IS_ROPE(b))
+    return false;
+  if (!IS_STRING_OR_ROPE(a) || !IS_STRING_OR_ROPE(b) ||
+      textLength(AS_OBJ(a)) != textLength(AS_OBJ(b)))
+    return false;
+  // flattening may collect, so the flat strings
+  // replace the ropes on the stack
+  if (IS_ROPE(b))
+    vm->stackTop[-1] = OBJ_VAL(flattenRope(AS_ROPE(b)));
+  if (IS_ROPE(a))
+    vm->stackTop[-2] = OBJ_VAL(flattenRope(AS_ROPE(a)));
+  return valuesEqual(peek(1), peek(0));
+}
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceExecution(CallFrame *frame)
+{
+  printf("          ");
+  for (Value *slot = vm->stack; slot < vm->stackTop; slot++)
+  {
+    printf("[");
+    printValue(*slot);
+    printf("]");
+  }
+  printf("\n");
+  disassembleInstruction(&frame->function->chunk, (int)(frame->ip - frame->function->chunk.code));
+}
+#endif
+// lets run() shadow the thread-local vm with a local copy,
+// loaded once instead of by every instruction
+static inline VM *currentVM()
+{
+  return vm;
 }
-InterpretResult run()
+// runs until the frame at baseFrame returns
+static InterpretResult run(int baseFrame)
 {
-  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  // the current VM does not change while run() runs
+  VM *const vm = currentVM();
+  CallFrame *frame = &vm->frames[vm->frameCount - 1];
 
 #define READ_BYTE() (*frame->ip++)
+// call() reserved the stack slots of the running function
+#define PUSH(value) (*vm->stackTop++ = (value))
+#define POP() (*--vm->stackTop)
+#define PEEK(distance) (vm->stackTop[-1 - (distance)])
 #define READ_SHORT() \
   (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define READ_CONSTANT() (frame->function->chunk.constants.values[READ_BYTE()])
+#define READ_CONSTANT_LONG() \
+  (frame->ip += 3, frame->function->chunk.constants.values[longOperand(frame->ip - 3)])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 #define BINARY_OP(valueType, op)                    \
   do                                                \
   {                                                 \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) \
     {                                               \
       runtimeError("Operands must be numbers.");    \
       return INTERPRET_RUNTIME_ERROR;               \
     }                                               \
-    double b = AS_NUMBER(pop());                    \
-    double a = AS_NUMBER(pop());                    \
-    push(valueType(a op b));                        \
+    double b = AS_NUMBER(POP());                    \
+    double a = AS_NUMBER(POP());                    \
+    PUSH(valueType(a op b));                        \
   } while (false)
+#define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
+// rewrites the current single-byte instruction into its
+// number-only form when both operands are numbers
+#define QUICKEN(quickened)                        \
+  do                                              \
+  {                                               \
+    if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) \
+      frame->ip[-1] = quickened;                  \
+  } while (false)
+// comparison in a quickened instruction, going back to
+// the generic instruction when an operand is not a number
+#define NUMBER_COMPARE(op, generic)                             \
+  do                                                            \
+  {                                                             \
+    Value b = PEEK(0);                                          \
+    Value a = PEEK(1);                                          \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b))                         \
+    {                                                           \
+      frame->ip[-1] = generic;                                  \
+      frame->ip--;                                              \
+    }                                                           \
+    else                                                        \
+    {                                                           \
+      vm->stackTop--;                                            \
+      vm->stackTop[-1] = BOOL_VAL(AS_NUMBER(a) op AS_NUMBER(b)); \
+    }                                                           \
+  } while (false)
+// the profiler samples at back-edges, calls and returns
+// so other instructions pay nothing for it
+#define SAFEPOINT()         \
+  do                        \
+  {                         \
+    if (profileSampleDue)   \
+      profileSample();      \
+  } while (false)
+// calls, returns and back-edges count towards compiling the running
+// function and go on in its machine code from there, if it has some
+#ifdef JIT
+#define TIER_UP()          \
+  do                       \
+  {                        \
+    if (vm->jitEnabled)    \
+      jitEnter(vm, frame); \
+  } while (false)
+#else
+#define TIER_UP() ((void)0)
+#endif
+// numeric comparison followed by a jump when it is false,
+// fused by the optimizer from OP_LESS/OP_GREATER and
+// OP_JUMP_IF_FALSE, OP_POP
+#define BRANCH_OP(op)                               \
+  do                                                \
+  {                                                 \
+    uint16_t offset = READ_SHORT();                 \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) \
+    {                                               \
+      runtimeError("Operands must be numbers.");    \
+      return INTERPRET_RUNTIME_ERROR;               \
+    }                                               \
+    double b = AS_NUMBER(POP());                    \
+    double a = AS_NUMBER(POP());                    \
+    if (!(a op b))                                  \
+      frame->ip += offset;                          \
+  } while (false)
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION() traceExecution(frame)
+#else
+#define TRACE_INSTRUCTION() ((void)0)
+#endif
 
+  uint8_t instruction;
+#ifdef COMPUTED_GOTO
+  // one handler label per opcode, indexed by the opcode byte
+  static void *dispatchTable[] = {
+      [OP_CONSTANT] = &&op_OP_CONSTANT,
+      [OP_NO_OP] = &&op_OP_NO_OP,
+      [OP_NIL] = &&op_OP_NIL,
+      [OP_TRUE] = &&op_OP_TRUE,
+      [OP_FALSE] = &&op_OP_FALSE,
+      [OP_POP] = &&op_OP_POP,
+      [OP_GET_LOCAL] = &&op_OP_GET_LOCAL,
+      [OP_SET_LOCAL] = &&op_OP_SET_LOCAL,
+      [OP_GET_GLOBAL] = &&op_OP_GET_GLOBAL,
+      [OP_DEFINE_GLOBAL] = &&op_OP_DEFINE_GLOBAL,
+      [OP_SET_GLOBAL] = &&op_OP_SET_GLOBAL,
+      [OP_GET_UPVALUE] = &&op_OP_GET_UPVALUE,
+      [OP_SET_UPVALUE] = &&op_OP_SET_UPVALUE,
+      [OP_EQUAL] = &&op_OP_EQUAL,
+      [OP_GREATER] = &&op_OP_GREATER,
+      [OP_LESS] = &&op_OP_LESS,
+      [OP_ADD] = &&op_OP_ADD,
+      [OP_SUBTRACT] = &&op_OP_SUBTRACT,
+      [OP_MULTIPLY] = &&op_OP_MULTIPLY,
+      [OP_DIVIDE] = &&op_OP_DIVIDE,
+      [OP_NOT] = &&op_OP_NOT,
+      [OP_NEGATE] = &&op_OP_NEGATE,
+      [OP_PRINT] = &&op_OP_PRINT,
+      [OP_JUMP] = &&op_OP_JUMP,
+      [OP_JUMP_IF_FALSE] = &&op_OP_JUMP_IF_FALSE,
+      [OP_LOOP] = &&op_OP_LOOP,
+      [OP_CALL] = &&op_OP_CALL,
+      [OP_CLOSURE] = &&op_OP_CLOSURE,
+      [OP_CLOSE_UPVALUE] = &&op_OP_CLOSE_UPVALUE,
+      [OP_RETURN] = &&op_OP_RETURN,
+      [OP_CONSTANT_LONG] = &&op_OP_CONSTANT_LONG,
+      [OP_CLOSURE_LONG] = &&op_OP_CLOSURE_LONG,
+      [OP_GET_CAPTURED] = &&op_OP_GET_CAPTURED,
+      [OP_NOT_EQUAL] = &&op_OP_NOT_EQUAL,
+      [OP_GREATER_EQUAL] = &&op_OP_GREATER_EQUAL,
+      [OP_LESS_EQUAL] = &&op_OP_LESS_EQUAL,
+      [OP_ADD_LOCALS] = &&op_OP_ADD_LOCALS,
+      [OP_JUMP_IF_FALSE_POP] = &&op_OP_JUMP_IF_FALSE_POP,
+      [OP_JUMP_IF_NOT_LESS] = &&op_OP_JUMP_IF_NOT_LESS,
+      [OP_JUMP_IF_NOT_GREATER] = &&op_OP_JUMP_IF_NOT_GREATER,
+      [OP_ADD_NUM] = &&op_OP_ADD_NUM,
+      [OP_LESS_NUM] = &&op_OP_LESS_NUM,
+      [OP_GREATER_NUM] = &&op_OP_GREATER_NUM,
+  };
+// every handler jumps straight to the next one, so the
+// switch below is only used to enter the first handler
+#define CASE(op) \
+  case op:       \
+  op_##op
+#define DISPATCH()                                  \
+  do                                                \
+  {                                                 \
+    TRACE_INSTRUCTION();                            \
+    goto *dispatchTable[instruction = READ_BYTE()]; \
+  } while (false)
+#else
+#define CASE(op) case op
+#define DISPATCH() break
+#endif
+
+  TIER_UP();
   for (;;)
   {
-#ifdef DEBUG_TRACE_EXECUTION
-    printf("          ");
-    for (Value *slot = vm.stack; slot < vm.stackTop; slot++)
-    {
-      printf("[");
-      printValue(*slot);
-      printf("]");
-    }
-    printf("\n");
-    disassembleInstruction(&frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));
-#endif
-    uint8_t instruction;
+    TRACE_INSTRUCTION();
     switch (instruction = READ_BYTE())
     {
-    case OP_CONSTANT:
+    CASE(OP_CONSTANT):
     {
       Value constant = READ_CONSTANT();
-      push(constant);
-      break;
+      PUSH(constant);
+      DISPATCH();
     }
-    case OP_NIL:
-      push(NIL_VAL);
-      break;
-    case OP_TRUE:
-      push(BOOL_VAL(true));
-      break;
-    case OP_FALSE:
-      push(BOOL_VAL(false));
-      break;
-    case OP_POP:
-      pop();
-      break;
-    case OP_GET_LOCAL:
+    CASE(OP_CONSTANT_LONG):
+    {
+      Value constant = READ_CONSTANT_LONG();
+      PUSH(constant);
+      DISPATCH();
+    }
+    CASE(OP_NIL):
+      PUSH(NIL_VAL);
+      DISPATCH();
+    CASE(OP_TRUE):
+      PUSH(BOOL_VAL(true));
+      DISPATCH();
+    CASE(OP_FALSE):
+      PUSH(BOOL_VAL(false));
+      DISPATCH();
+    CASE(OP_POP):
+      vm->stackTop--;
+      DISPATCH();
+    CASE(OP_GET_LOCAL):
     {
       uint8_t slot = READ_BYTE();
-      push(frame->slots[slot]);
-      break;
+      PUSH(frame->slots[slot]);
+      DISPATCH();
     }
-    case OP_SET_LOCAL:
+    CASE(OP_SET_LOCAL):
     {
       uint8_t slot = READ_BYTE();
-      frame->slots[slot] = peek(0);
+      // the stack needs no snapshotBarrier()
+      frame->slots[slot] = PEEK(0);
       // no pop, since an assignment is
       // an expression whose value is itself
-      break;
+      DISPATCH();
     }
-    case OP_GET_GLOBAL:
+    CASE(OP_GET_GLOBAL):
     {
-      ObjString *name = READ_STRING();
-      Value value;
-      if (!tableGet(&vm.globals, name, &value))
+      uint16_t slot = READ_SHORT();
+      Value value = vm->globalValues.values[slot];
+      if (IS_UNDEFINED(value))
       {
-        runtimeError("Undefined variable '%s'.", name->chars);
+        runtimeError("Undefined variable '%s'.", globalName(slot)->chars);
         return INTERPRET_RUNTIME_ERROR;
       }
       // printValue(value);
-      push(value);
-      break;
+      PUSH(value);
+      DISPATCH();
     }
-    case OP_DEFINE_GLOBAL:
+    CASE(OP_DEFINE_GLOBAL):
     {
-      ObjString *name = READ_STRING();
-      debugLog("defined global variable '%s'.", name->chars);
-      tableSet(&vm.globals, name, peek(0));
-      pop();
-      break;
+      uint16_t slot = READ_SHORT();
+      debugLog("defined global variable in slot %d.", slot);
+      // a global may be defined again
+      snapshotBarrier(vm->globalValues.values[slot]);
+      vm->globalValues.values[slot] = PEEK(0);
+      globalWriteBarrier(slot, PEEK(0));
+      vm->stackTop--;
+      DISPATCH();
     }
-    case OP_SET_GLOBAL:
+    CASE(OP_SET_GLOBAL):
     {
-      ObjString *name = READ_STRING();
-      if (tableSet(&vm.globals, name, peek(0)))
+      uint16_t slot = READ_SHORT();
+      Value *global = &vm->globalValues.values[slot];
+      if (IS_UNDEFINED(*global))
       {
-        tableDelete(&vm.globals, name);
-        runtimeError("Undefined variable '%s'.", name->chars);
+        runtimeError("Undefined variable '%s'.", globalName(slot)->chars);
         return INTERPRET_RUNTIME_ERROR;
       }
-      break;
+      snapshotBarrier(*global);
+      *global = PEEK(0);
+      globalWriteBarrier(slot, PEEK(0));
+      DISPATCH();
     }
-    case OP_GET_UPVALUE:
+    CASE(OP_GET_UPVALUE):
     {
       uint8_t slot = READ_BYTE();
-      push(*frame->closure->upvalues[slot]->location);
-      break;
+      PUSH(*AS_UPVALUE(frame->upvalues[slot])->location);
+      DISPATCH();
     }
-    case OP_SET_UPVALUE:
+    CASE(OP_GET_CAPTURED):
+    {
+      PUSH(frame->upvalues[READ_BYTE()]);
+      DISPATCH();
+    }
+    CASE(OP_SET_UPVALUE):
     {
       uint8_t slot = READ_BYTE();
-      *frame->closure->upvalues[slot]->location = peek(0);
-      break;
+      ObjUpvalue *upvalue = AS_UPVALUE(frame->upvalues[slot]);
+      snapshotBarrier(*upvalue->location);
+      *upvalue->location = PEEK(0);
+      // a closed upvalue holds the value itself
+      writeValueBarrier((Obj *)upvalue, PEEK(0));
+      DISPATCH();
     }
-    case OP_EQUAL:
+    CASE(OP_EQUAL):
     {
       // binary_op won't work because ==
       // does not compare structs
       //(Value is a struct in C)
-      Value b = pop();
-      Value a = pop();
-      push(BOOL_VAL(valuesEqual(a, b)));
-      break;
+      bool equal = topValuesEqual();
+      vm->stackTop--;
+      vm->stackTop[-1] = BOOL_VAL(equal);
+      DISPATCH();
     }
-    case OP_GREATER:
+    CASE(OP_GREATER):
+      QUICKEN(OP_GREATER_NUM);
       BINARY_OP(BOOL_VAL, >);
-      break;
-    case OP_LESS:
+      DISPATCH();
+    CASE(OP_LESS):
+      QUICKEN(OP_LESS_NUM);
       BINARY_OP(BOOL_VAL, <);
-      break;
-    case OP_ADD:
+      DISPATCH();
+    CASE(OP_ADD):
+    addValues:
     {
-      if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+      if (IS_STRING_OR_ROPE(PEEK(0)) && IS_STRING_OR_ROPE(PEEK(1)))
       {
-        concatenate();
+        if (!concatenate())
+        {
+          runtimeError("String too long.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
         // else check IS_NUMBER
       }
-      else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
+      else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))
       {
-        double a = AS_NUMBER(pop());
-        double b = AS_NUMBER(pop());
-        push(NUMBER_VAL(a + b));
+        // OP_ADD_LOCALS only falls back to here for
+        // non-numbers, so ip[-1] is always this OP_ADD
+        frame->ip[-1] = OP_ADD_NUM;
+        double a = AS_NUMBER(POP());
+        double b = AS_NUMBER(POP());
+        PUSH(NUMBER_VAL(a + b));
       }
       else
       {
         runtimeError("Operands must both be numbers or strings to add");
         return INTERPRET_RUNTIME_ERROR;
       }
-      break;
+      DISPATCH();
     }
-    case OP_SUBTRACT:
+    CASE(OP_SUBTRACT):
       BINARY_OP(NUMBER_VAL, -);
-      break;
-    case OP_MULTIPLY:
+      DISPATCH();
+    CASE(OP_MULTIPLY):
       BINARY_OP(NUMBER_VAL, *);
-      break;
-    case OP_DIVIDE:
+      DISPATCH();
+    CASE(OP_DIVIDE):
       BINARY_OP(NUMBER_VAL, /);
-      break;
-    case OP_NOT:
-      push(BOOL_VAL(isFalsey(pop())));
-      break;
-    case OP_NEGATE:
+      DISPATCH();
+    CASE(OP_NOT):
+      vm->stackTop[-1] = BOOL_VAL(isFalsey(PEEK(0)));
+      DISPATCH();
+    CASE(OP_NEGATE):
       //-"Asd" or -false is not allowed
-      if (!IS_NUMBER(peek(0)))
+      if (!IS_NUMBER(PEEK(0)))
       {
         runtimeError("Operand must be a number");
         return INTERPRET_RUNTIME_ERROR;
       }
-      push(NUMBER_VAL(-AS_NUMBER(pop())));
-      break;
-    case OP_PRINT:
+      vm->stackTop[-1] = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+      DISPATCH();
+    CASE(OP_PRINT):
     {
-      printValue(pop());
+      printValue(POP());
       printf("\n");
-      break;
+      DISPATCH();
     }
-    case OP_JUMP:
+    CASE(OP_JUMP):
     {
       uint16_t offset = READ_SHORT();
       frame->ip += offset;
-      break;
+      DISPATCH();
     }
-    case OP_JUMP_IF_FALSE:
+    CASE(OP_JUMP_IF_FALSE):
     {
       uint16_t offset = READ_SHORT();
-      if (isFalsey(peek(0)))
+      if (isFalsey(PEEK(0)))
         frame->ip += offset;
-      break;
+      DISPATCH();
     }
-    case OP_LOOP:
+    CASE(OP_LOOP):
     {
       uint16_t offset = READ_SHORT();
+      SAFEPOINT();
       frame->ip -= offset;
-      break;
+      TIER_UP();
+      DISPATCH();
     }
     // stack is like this
     // OP_CALL (4) | 1 | 2 | 3 | 4 | _
     // argument values are after the OP_CALL
-    case OP_CALL:
+    CASE(OP_CALL):
     {
       int argCount = READ_BYTE();
-      if (!callValue(peek(argCount), argCount))
+      SAFEPOINT();
+      if (!callValue(PEEK(argCount), argCount))
       {
         return INTERPRET_RUNTIME_ERROR;
       }
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+      frame = &vm->frames[vm->frameCount - 1];
+      TIER_UP();
+      DISPATCH();
     }
-    case OP_CLOSURE:
+    CASE(OP_CLOSURE):
+    CASE(OP_CLOSURE_LONG):
     {
-      ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+      ObjFunction *function = AS_FUNCTION(instruction == OP_CLOSURE ? READ_CONSTANT()
+                                                                    : READ_CONSTANT_LONG());
+      // a closure even when nothing is captured, so each evaluation
+      // of a declaration is a function that == tells apart
       ObjClosure *closure = newClosure(function);
-      push(OBJ_VAL(closure));
+      PUSH(OBJ_VAL(closure));
       // capture the upvalues and store in this closure
       for (int i = 0; i < closure->upvalueCount; i++)
       {
-        uint8_t isLocal = READ_BYTE();
+        uint8_t capture = READ_BYTE();
         uint8_t index = READ_BYTE();
-        if (isLocal)
-        {
-          closure->upvalues[i] = captureUpvalue(frame->slots + index);
-        }
+        if (capture == CAPTURE_LOCAL)
+          closure->upvalues[i] = OBJ_VAL(captureUpvalue(frame, frame->slots + index));
+        else if (capture == CAPTURE_VALUE)
+          closure->upvalues[i] = frame->slots[index];
         else
-        {
-          closure->upvalues[i] = frame->closure->upvalues[index];
-        }
+          closure->upvalues[i] = frame->upvalues[index];
+        // capturing may have collected and promoted the closure
+        writeValueBarrier((Obj *)closure, closure->upvalues[i]);
       }
-      break;
+      DISPATCH();
     }
-    case OP_CLOSE_UPVALUE:
+    CASE(OP_CLOSE_UPVALUE):
     {
-      closeUpvalues(vm.stackTop - 1);
-      pop();
-      break;
+      ObjUpvalue **open = &vm->openSlots[vm->stackTop - 1 - vm->stack];
+      if (*open != NULL)
+      {
+        closeUpvalue(open);
+        frame->openUpvalues--;
+      }
+      vm->stackTop--;
+      DISPATCH();
     }
-    case OP_RETURN:
+    CASE(OP_RETURN):
     {
-      Value result = pop();
-      closeUpvalues(frame->slots);
-      vm.frameCount--;
-      if (vm.frameCount == 0)
-      {
-        pop();
+      SAFEPOINT();
+      Value result = POP();
+      if (frame->openUpvalues > 0)
+        closeUpvalues(frame->slots);
+      vm->frameCount--;
+      vm->stackTop = frame->slots;
+      PUSH(result);
+      if (vm->frameCount == baseFrame)
         return INTERPRET_OK;
+      frame = &vm->frames[vm->frameCount - 1];
+      TIER_UP();
+      DISPATCH();
+    }
+    CASE(OP_NO_OP):
+      DISPATCH();
+    CASE(OP_NOT_EQUAL):
+    {
+      bool equal = topValuesEqual();
+      vm->stackTop--;
+      vm->stackTop[-1] = BOOL_VAL(!equal);
+      DISPATCH();
+    }
+    // written as negations so comparisons with NaN give
+    // the same result as the OP_LESS/OP_GREATER, OP_NOT pair
+    CASE(OP_GREATER_EQUAL):
+      BINARY_OP(NOT_BOOL_VAL, <);
+      DISPATCH();
+    CASE(OP_LESS_EQUAL):
+      BINARY_OP(NOT_BOOL_VAL, >);
+      DISPATCH();
+    CASE(OP_ADD_LOCALS):
+    {
+      Value a = frame->slots[READ_BYTE()];
+      Value b = frame->slots[READ_BYTE()];
+      if (IS_NUMBER(a) && IS_NUMBER(b))
+      {
+        PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+        DISPATCH();
       }
-      vm.stackTop = frame->slots;
-      push(result);
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+      // strings and errors are handled by OP_ADD
+      PUSH(a);
+      PUSH(b);
+      goto addValues;
     }
-    case OP_NO_OP:
-      break;
+    CASE(OP_JUMP_IF_FALSE_POP):
+    {
+      uint16_t offset = READ_SHORT();
+      if (isFalsey(POP()))
+        frame->ip += offset;
+      DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_LESS):
+      BRANCH_OP(<);
+      DISPATCH();
+    CASE(OP_JUMP_IF_NOT_GREATER):
+      BRANCH_OP(>);
+      DISPATCH();
+    // quickened forms: rewritten in place by the generic
+    // instruction once it has seen two numbers. When the guard
+    // fails they rewrite themselves back and re-run the generic one.
+    CASE(OP_ADD_NUM):
+    {
+      Value b = PEEK(0);
+      Value a = PEEK(1);
+      if (!IS_NUMBER(a) || !IS_NUMBER(b))
+      {
+        frame->ip[-1] = OP_ADD;
+        frame->ip--;
+        DISPATCH();
+      }
+      vm->stackTop--;
+      vm->stackTop[-1] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+      DISPATCH();
+    }
+    CASE(OP_LESS_NUM):
+      NUMBER_COMPARE(<, OP_LESS);
+      DISPATCH();
+    CASE(OP_GREATER_NUM):
+      NUMBER_COMPARE(>, OP_GREATER);
+      DISPATCH();
     }
   }
 #undef READ_BYTE
+#undef PUSH
 #undef READ_SHORT
 #undef READ_CONSTANT
+#undef READ_CONSTANT_LONG
 #undef READ_STRING
 #undef BINARY_OP
+#undef BRANCH_OP
+#undef NOT_BOOL_VAL
+#undef SAFEPOINT
+#undef TIER_UP
+#undef QUICKEN
+#undef NUMBER_COMPARE
+#undef TRACE_INSTRUCTION
+#undef CASE
+#undef DISPATCH
+#undef PEEK
+#undef POP
+}
+// calls the value below the argCount arguments on top of the
+// stack and leaves its result in their place. On an error the
+// stack and frames go back to how they were before the callee
+// was pushed, so the caller (a native, the API or interpret())
+// can carry on
+InterpretResult callAndRun(int argCount)
+{
+  int calleeSlot = (int)(vm->stackTop - vm->stack) - argCount - 1;
+  int baseFrame = vm->frameCount;
+  InterpretResult result = INTERPRET_OK;
+  if (!callValue(peek(argCount), argCount))
+    result = INTERPRET_RUNTIME_ERROR;
+  else if (vm->frameCount > baseFrame)
+    result = run(baseFrame);
+  if (result != INTERPRET_OK)
+  {
+    closeUpvalues(vm->stack + calleeSlot);
+    vm->stackTop = vm->stack + calleeSlot;
+    vm->frameCount = baseFrame;
+  }
+  return result;
 }
 InterpretResult interpret(const char *source)
 {
   ObjFunction *function = compile(source);
   if (function == NULL)
     return INTERPRET_COMPILE_ERROR;
-
-  // CallFrame *frame = &vm.frames[vm.frameCount++];
+  return interpretFunction(function);
+}
+// runs a compiled script, from compile() or a cache file
+InterpretResult interpretFunction(ObjFunction *function)
+{
+  // CallFrame *frame = &vm->frames[vm->frameCount++];
   // frame->function = function;
   // frame->ip = function->chunk.code;
-  // frame->slots = vm.stack;
+  // frame->slots = vm->stack;
+  // a script captures nothing, it runs without a closure
   push(OBJ_VAL(function));
-  ObjClosure *closure = newClosure(function);
-  pop();
-  push(OBJ_VAL(closure));
-  call(closure, 0);
-  InterpretResult result = run();
+  InterpretResult result = callAndRun(0);
+  if (result == INTERPRET_OK)
+    pop();
 
   // freeChunk(&chunk);//chunk is owned by ObjFunction
   return result;
@@ -477,6 +990,6 @@ InterpretResult interpret(const char *source)
   //   freeChunk(&chunk);
   //   return INTERPRET_COMPILE_ERROR;
   // }
-  // vm.chunk = &chunk;
-  // vm.ip = vm.chunk->code;
+  // vm->chunk = &chunk;
+  // vm->ip = vm->chunk->code;
 }
\ No newline at end of file
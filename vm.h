@@ -3,38 +3,147 @@
 
 #include "object.h"
 #include "chunk.h"
+#include "memory.h"
+#include "pool.h"
 #include "table.h"
 #include "value.h"
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// both stacks start small and grow on demand up to
+// the hard limits, past which a call is a stack overflow.
+// Limits are counted in frames and in values. FRAMES_MAX is
+// the default of vm->framesMax, which --max-frames sets
+#define FRAMES_INITIAL 16
+#define STACK_INITIAL UINT8_COUNT
+#ifndef FRAMES_MAX
+#define FRAMES_MAX (1024 * 1024)
+#endif
+#ifndef STACK_MAX
+#define STACK_MAX (16 * 1024 * 1024)
+#endif
+// global slots are 16-bit operands
+#define GLOBALS_MAX (UINT16_MAX + 1)
+// global slots per card of the globals write barrier
+#define GLOBAL_CARD_SIZE 64
+// old objects are kept in this many lists,
+// which a parallel sweep shares out among its threads
+#define GC_REGIONS 64
+// most threads a collection uses unless told otherwise
+#define GC_THREADS_DEFAULT 8
+// what an incremental major collection is doing between two steps
+typedef enum
+{
+  GC_IDLE,
+  GC_MARK,
+  GC_SWEEP
+} GCPhase;
+// the kinds of pauses of the collector: minor collections, steps of
+// incremental major ones and major ones done in a single pause
+typedef enum
+{
+  PAUSE_MINOR,
+  PAUSE_STEP,
+  PAUSE_FULL,
+  PAUSE_KINDS
+} PauseKind;
 typedef struct
 {
-  // ObjFunction *function;
-  ObjClosure *closure;
+  int count;
+  uint64_t totalNanos;
+  uint64_t maxNanos;
+} PauseStats;
+typedef struct
+{
+  // the running function and the upvalues of its closure.
+  // A script runs without a closure
+  ObjFunction *function;
+  Value *upvalues;
   uint8_t *ip;
   // the start of the slots in the VM's stack
   Value *slots;
+  // open upvalues of the slots, OP_RETURN closes them
+  int openUpvalues;
 } CallFrame;
-typedef struct
+// all the state of one interpreter, there
+// can be any number of them in a process
+typedef struct VM
 {
   // Chunk *chunk; ->is now in the function
   // points to the instruction to be executed
   // is specific to a function
   // uint8_t *ip; // pointer to instruction in chunk
-  CallFrame frames[FRAMES_MAX];
+  CallFrame *frames;
   int frameCount;
-  Value stack[STACK_MAX];
+  int frameCapacity;
+  // calls past this many frames are a stack overflow
+  int framesMax;
+  Value *stack;
   // top = ununsed space at the top,
   // next value pushed is here
   Value *stackTop;
-  // global variables
-  Table globals;
+  // one past the last allocated stack slot
+  Value *stackEnd;
+  // stack index of API index 0: the first argument
+  // of the running native, else the stack bottom
+  int apiBase;
+  // global variables live in a dense array, the compiler
+  // resolves every global name to its slot in it
+  ValueArray globalValues;
+  // global variable names mapped to their slot number
+  Table globalNames;
   // interned strings (unique strings stored only once)
   Table strings;
-  // upvalues as linked list
-  ObjUpvalue *openUpvalues;
-  // objects as linked list
-  Obj *objects;
+  // the open upvalue of each stack slot, NULL if there is none
+  ObjUpvalue **openSlots;
+  // old objects as linked lists, swept by major collections.
+  // Each collection promotes to the next list in turn
+  Obj *objects[GC_REGIONS];
+  int promoteRegion;
+  // the nursery: objects allocated since the last collection,
+  // swept by every collection, which promotes the survivors
+  Obj *youngObjects;
+  // bytes handed out by reallocate() and the
+  // heap size that triggers the next major collection
+  size_t bytesAllocated;
+  size_t nextGC;
+  // bytes allocated since the last collection
+  size_t youngBytes;
+  // set while a minor collection marks, which
+  // takes every old object as reachable
+  bool minorCollection;
+  // minor collections since the last major one
+  int minorCollections;
+  // threads of major collections of large heaps, started on demand
+  int gcThreads;
+  struct Workers *gcWorkers;
+  // longest step of an incremental major collection in microseconds,
+  // 0 collects in one pause
+  int gcPauseMicros;
+  GCPhase gcPhase;
+  // bytes allocated since the last step
+  size_t stepBytes;
+  // the old lists left to sweep, survivors go back to vm->objects
+  Obj *unswept[GC_REGIONS];
+  int sweepRegion;
+  PauseStats pauses[PAUSE_KINDS];
+  // compile hot functions to machine code, off unless asked for,
+  // and name the code in /tmp/perf-<pid>.map for perf
+  bool jitEnabled;
+  bool perfMap;
+  // old objects that were written a reference to a young one
+  int rememberedCount;
+  int rememberedCapacity;
+  Obj **remembered;
+  // globals cards and names that may hold young objects
+  bool globalCards[GLOBALS_MAX / GLOBAL_CARD_SIZE];
+  bool globalNamesDirty;
+  // marked objects whose references are not traced yet
+  int grayCount;
+  int grayCapacity;
+  Obj **grayStack;
+  // size-class pools of the objects
+  Pools pools;
+  // cache files the loaded functions point into
+  struct CacheMapping *cacheMappings;
+  int cacheMappingCount;
 } VM;
 
 typedef enum
@@ -44,12 +153,37 @@ typedef enum
   INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-extern VM vm;
+// the VM this thread runs, set by newVM()
+// and by every entry point of clox.h
+extern THREAD_LOCAL VM *vm;
 
-void initVM();
+VM *newVM();
 void freeVM();
 InterpretResult interpret(const char *source);
+InterpretResult interpretFunction(ObjFunction *function);
+InterpretResult callAndRun(int argCount);
+void runtimeError(const char *format, ...);
+void defineNative(const char *name, NativeFn function, int arity);
+// a global is outside the heap, its card is marked instead
+// of remembering an object when it is written a young object
+static inline void globalWriteBarrier(int slot, Value value)
+{
+  if (IS_OBJ(value) && !hasFlag(AS_OBJ(value), OBJ_OLD))
+    vm->globalCards[slot / GLOBAL_CARD_SIZE] = true;
+}
+// must precede every store over a reference outside the stack. An
+// incremental collection marks what was reachable when it started,
+// so the value overwritten is marked in case it is only reachable
+// from where the mutator moved it since. The stack is marked whole
+// when the collection starts, stores to locals need no barrier
+static inline void snapshotBarrier(Value old)
+{
+  if (vm->gcPhase == GC_MARK)
+    markValue(old);
+}
 void push(Value);
 Value pop();
+int globalSlot(ObjString *name);
+ObjString *globalName(int slot);
 
 #endif
\ No newline at end of file
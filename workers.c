@@ -0,0 +1,294 @@
+#include "workers.h"
+
+#ifdef PARALLEL_GC
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Work-stealing deques after Chase and Lev, in the C11 formulation
+// of Le, Pop, Cohen and Zappa Nardelli. The owner pushes and pops at
+// the bottom without locking, thieves take from the top with a CAS,
+// and the two only race for the last item. A full buffer is replaced
+// by one twice its size, the old one is kept until the run is over
+// because a thief may still be reading it.
+//
+// A worker that finds no work anywhere counts itself idle and waits
+// for some to show up. Only busy workers push, so once all of them
+// are idle every deque is empty and stays so, which ends the run.
+
+#define DEQUE_INITIAL (1 << 10)
+
+typedef struct DequeBuffer
+{
+  int64_t capacity;
+  struct DequeBuffer *retired;
+  void *items[];
+} DequeBuffer;
+
+typedef struct
+{
+  int64_t top;
+  int64_t bottom;
+  DequeBuffer *buffer;
+} Deque;
+
+typedef struct
+{
+  Workers *workers;
+  int index;
+} WorkerStart;
+
+struct Workers
+{
+  int count;
+  Deque *deques;
+  // the threads of workers 1 to count - 1
+  pthread_t *threads;
+  WorkerStart *starts;
+  pthread_mutex_t lock;
+  pthread_cond_t started;
+  pthread_cond_t finished;
+  // bumped for every task, under lock
+  unsigned generation;
+  int running;
+  bool stopping;
+  void (*task)(void *context, int worker);
+  void *context;
+  // workers out of work in workTake()
+  int idle;
+};
+
+static DequeBuffer *newBuffer(int64_t capacity)
+{
+  DequeBuffer *buffer = (DequeBuffer *)malloc(sizeof(DequeBuffer) + sizeof(void *) * capacity);
+  if (buffer == NULL)
+    exit(1);
+  buffer->capacity = capacity;
+  buffer->retired = NULL;
+  return buffer;
+}
+static DequeBuffer *growDeque(Deque *deque, DequeBuffer *buffer, int64_t top, int64_t bottom)
+{
+  DequeBuffer *grown = newBuffer(buffer->capacity * 2);
+  for (int64_t i = top; i < bottom; i++)
+    grown->items[i & (grown->capacity - 1)] =
+        __atomic_load_n(&buffer->items[i & (buffer->capacity - 1)], __ATOMIC_RELAXED);
+  grown->retired = buffer;
+  __atomic_store_n(&deque->buffer, grown, __ATOMIC_RELEASE);
+  return grown;
+}
+static void dequePush(Deque *deque, void *item)
+{
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  DequeBuffer *buffer = __atomic_load_n(&deque->buffer, __ATOMIC_RELAXED);
+  if (bottom - top > buffer->capacity - 1)
+    buffer = growDeque(deque, buffer, top, bottom);
+  __atomic_store_n(&buffer->items[bottom & (buffer->capacity - 1)], item, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+static void *dequePop(Deque *deque)
+{
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+  DequeBuffer *buffer = __atomic_load_n(&deque->buffer, __ATOMIC_RELAXED);
+  __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+  void *item = NULL;
+  if (top <= bottom)
+  {
+    item = __atomic_load_n(&buffer->items[bottom & (buffer->capacity - 1)], __ATOMIC_RELAXED);
+    if (top == bottom)
+    {
+      // the last item, a thief may be taking it too
+      if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        item = NULL;
+      __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+  }
+  else
+  {
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  }
+  return item;
+}
+static void *dequeSteal(Deque *deque)
+{
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+  if (top >= bottom)
+    return NULL;
+  DequeBuffer *buffer = __atomic_load_n(&deque->buffer, __ATOMIC_ACQUIRE);
+  void *item = __atomic_load_n(&buffer->items[top & (buffer->capacity - 1)], __ATOMIC_RELAXED);
+  // another thief or the owner got it first
+  if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    return NULL;
+  return item;
+}
+static bool dequeEmpty(Deque *deque)
+{
+  return __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE) <=
+         __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+}
+static void freeRetired(Deque *deque)
+{
+  DequeBuffer *retired = deque->buffer->retired;
+  while (retired != NULL)
+  {
+    DequeBuffer *next = retired->retired;
+    free(retired);
+    retired = next;
+  }
+  deque->buffer->retired = NULL;
+}
+
+static void *workerMain(void *argument)
+{
+  WorkerStart *start = (WorkerStart *)argument;
+  Workers *workers = start->workers;
+  unsigned seen = 0;
+  pthread_mutex_lock(&workers->lock);
+  for (;;)
+  {
+    while (workers->generation == seen && !workers->stopping)
+      pthread_cond_wait(&workers->started, &workers->lock);
+    if (workers->stopping)
+      break;
+    seen = workers->generation;
+    pthread_mutex_unlock(&workers->lock);
+    workers->task(workers->context, start->index);
+    pthread_mutex_lock(&workers->lock);
+    if (--workers->running == 0)
+      pthread_cond_signal(&workers->finished);
+  }
+  pthread_mutex_unlock(&workers->lock);
+  return NULL;
+}
+Workers *newWorkers(int count)
+{
+  Workers *workers = (Workers *)calloc(1, sizeof(Workers));
+  if (workers == NULL)
+    exit(1);
+  workers->count = count;
+  workers->deques = (Deque *)calloc(count, sizeof(Deque));
+  workers->threads = (pthread_t *)malloc(sizeof(pthread_t) * count);
+  workers->starts = (WorkerStart *)malloc(sizeof(WorkerStart) * count);
+  if (workers->deques == NULL || workers->threads == NULL || workers->starts == NULL)
+    exit(1);
+  for (int i = 0; i < count; i++)
+    workers->deques[i].buffer = newBuffer(DEQUE_INITIAL);
+  pthread_mutex_init(&workers->lock, NULL);
+  pthread_cond_init(&workers->started, NULL);
+  pthread_cond_init(&workers->finished, NULL);
+  for (int i = 1; i < count; i++)
+  {
+    workers->starts[i].workers = workers;
+    workers->starts[i].index = i;
+    if (pthread_create(&workers->threads[i], NULL, workerMain, &workers->starts[i]) != 0)
+      exit(1);
+  }
+  return workers;
+}
+void freeWorkers(Workers *workers)
+{
+  if (workers == NULL)
+    return;
+  pthread_mutex_lock(&workers->lock);
+  workers->stopping = true;
+  pthread_cond_broadcast(&workers->started);
+  pthread_mutex_unlock(&workers->lock);
+  for (int i = 1; i < workers->count; i++)
+    pthread_join(workers->threads[i], NULL);
+  for (int i = 0; i < workers->count; i++)
+  {
+    freeRetired(&workers->deques[i]);
+    free(workers->deques[i].buffer);
+  }
+  pthread_mutex_destroy(&workers->lock);
+  pthread_cond_destroy(&workers->started);
+  pthread_cond_destroy(&workers->finished);
+  free(workers->deques);
+  free(workers->threads);
+  free(workers->starts);
+  free(workers);
+}
+int workerCount(Workers *workers)
+{
+  return workers->count;
+}
+void runWorkers(Workers *workers, void (*task)(void *context, int worker), void *context)
+{
+  pthread_mutex_lock(&workers->lock);
+  workers->task = task;
+  workers->context = context;
+  workers->idle = 0;
+  workers->running = workers->count - 1;
+  workers->generation++;
+  pthread_cond_broadcast(&workers->started);
+  pthread_mutex_unlock(&workers->lock);
+  task(context, 0);
+  pthread_mutex_lock(&workers->lock);
+  while (workers->running > 0)
+    pthread_cond_wait(&workers->finished, &workers->lock);
+  pthread_mutex_unlock(&workers->lock);
+  for (int i = 0; i < workers->count; i++)
+    freeRetired(&workers->deques[i]);
+}
+void workPush(Workers *workers, int worker, void *item)
+{
+  dequePush(&workers->deques[worker], item);
+}
+static void *stealAny(Workers *workers, int worker)
+{
+  for (int i = 1; i < workers->count; i++)
+  {
+    void *item = dequeSteal(&workers->deques[(worker + i) % workers->count]);
+    if (item != NULL)
+      return item;
+  }
+  return NULL;
+}
+static bool anyWork(Workers *workers)
+{
+  for (int i = 0; i < workers->count; i++)
+  {
+    if (!dequeEmpty(&workers->deques[i]))
+      return true;
+  }
+  return false;
+}
+int processorCount()
+{
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (int)count : 1;
+}
+void *workTake(Workers *workers, int worker)
+{
+  void *item = dequePop(&workers->deques[worker]);
+  if (item != NULL)
+    return item;
+  for (;;)
+  {
+    item = stealAny(workers, worker);
+    if (item != NULL)
+      return item;
+    __atomic_add_fetch(&workers->idle, 1, __ATOMIC_SEQ_CST);
+    for (;;)
+    {
+      if (__atomic_load_n(&workers->idle, __ATOMIC_SEQ_CST) == workers->count)
+        return NULL;
+      if (anyWork(workers))
+        break;
+      sched_yield();
+    }
+    __atomic_sub_fetch(&workers->idle, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+#endif
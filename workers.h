@@ -0,0 +1,25 @@
+#ifndef clox_workers_h
+#define clox_workers_h
+
+#include "common.h"
+
+// a pool of threads that run one task at a time together, each with
+// a work-stealing deque of pointers. The calling thread is worker 0
+typedef struct Workers Workers;
+
+int processorCount();
+
+Workers *newWorkers(int count);
+void freeWorkers(Workers *workers);
+int workerCount(Workers *workers);
+// runs task(context, worker) on every worker
+// and returns once all of them are done
+void runWorkers(Workers *workers, void (*task)(void *context, int worker), void *context);
+// only the worker itself pushes to its deque, or
+// the calling thread before runWorkers()
+void workPush(Workers *workers, int worker, void *item);
+// an item of the worker's own deque, else one stolen from
+// another worker. NULL once every worker is out of work
+void *workTake(Workers *workers, int worker);
+
+#endif